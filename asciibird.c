@@ -0,0 +1,851 @@
+/**
+ * @file
+ * @author Hamik Mukelyan
+ *
+ * libasciibird: simulation, collision, drawing and the built-in policies.
+ * See asciibird.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "asciibird.h"
+
+//-------------------------------- Definitions --------------------------------
+
+/**
+ * Number of ticks the lookahead policy searches ahead, two seconds' worth.
+ * Flapping every tick, Flappy takes about this long to climb from the bottom
+ * of one opening to the top of the next.
+ */
+#define SEARCH_HORIZON 48
+
+/** Tallest world the lookahead policy searches; taller ones fall back. */
+#define SEARCH_ROWS 128
+
+/**
+ * Scratch space for lookahead_flap(). 'memo' remembers whether Flappy can
+ * survive to the search horizon from each state already searched for the
+ * current decision. memo[row0 + 1][t][k] is for Flappy t ticks after a flap
+ * from row0, k ticks from now; a row0 of -1 means he hasn't flapped since
+ * now, so k alone says where he is and t is 0. An entry holds the 'stamp' of
+ * the decision that filled it in, shifted left one, and the answer in the
+ * low bit, so moving on to the next decision needn't clear the table.
+ */
+typedef struct lookahead {
+	uint16_t memo[SEARCH_ROWS][SEARCH_HORIZON][SEARCH_HORIZON];
+	uint16_t stamp;
+
+	/* The pipes that can still hit Flappy within the horizon, as of now. */
+	vpipe pipes[MAX_PIPES];
+	int num_pipes, rows;
+} lookahead;
+
+//----------------------------- Global Constants ------------------------------
+
+/**
+ * Flappy in each pose, anchored at his body. Flapping alternates between
+ * wings down and wings up every three frames.
+ *
+ *     falling     wings down   wings up
+ *     \   /                    \   /
+ *      \0/         /0\          \0/
+ *                 /   \
+ */
+static const sprite_cell FLAPPY_SPRITES[NUM_POSES][SPRITE_CELLS] = {
+	{ { -1, -2, '\\' }, { 0, -1, '\\' }, { 0, 0, '0' }, { 0, 1, '/' },
+	  { -1, 2, '/' } },
+	{ { 1, -2, '/' }, { 0, -1, '/' }, { 0, 0, '0' }, { 0, 1, '\\' },
+	  { 1, 2, '\\' } },
+	{ { -1, -2, '\\' }, { 0, -1, '\\' }, { 0, 0, '0' }, { 0, 1, '/' },
+	  { -1, 2, '/' } },
+};
+
+//----------------------------- Global Variables ------------------------------
+
+/**
+ * Key to each thread's own scratch space for lookahead_flap(), which is too
+ * big to be thread-local storage in every thread of every program that links
+ * the library. It's allocated the first time a thread needs it and freed
+ * when the thread exits.
+ */
+static pthread_key_t search_key;
+static pthread_once_t search_once = PTHREAD_ONCE_INIT;
+static int search_key_made = 0;
+
+//--------------------------------- Functions ---------------------------------
+
+/**
+ * Sets up a canvas to draw into the given cells.
+ *
+ * @param[out] cv
+ * @param cells rows x cols chars, row-major, owned by the caller.
+ * @param rows
+ * @param cols
+ */
+void canvas_init(canvas *cv, char *cells, int rows, int cols) {
+	cv->cells = cells;
+	cv->rows = rows;
+	cv->cols = cols;
+	cv->stripe_ch = 0;
+	cv->stripe_spacing = 0;
+}
+
+/**
+ * Blanks a canvas before a new frame is drawn into it.
+ *
+ * @param cv
+ */
+void canvas_clear(canvas *cv) {
+	memset(cv->cells, ' ', cv->rows * cv->cols);
+}
+
+/**
+ * Writes a char into a canvas. Cells off the canvas are ignored.
+ *
+ * @param cv
+ * @param row
+ * @param col
+ * @param ch Char to draw.
+ */
+void put_ch(canvas *cv, int row, int col, char ch) {
+	if (row >= 0 && row < cv->rows && col >= 0 && col < cv->cols)
+		cv->cells[row * cv->cols + col] = ch;
+}
+
+/**
+ * Writes a string into a canvas, clipped to it.
+ *
+ * @param cv
+ * @param row
+ * @param col Column of the first char.
+ * @param str
+ */
+void put_str(canvas *cv, int row, int col, const char *str) {
+	for (; *str; str++, col++)
+		put_ch(cv, row, col, *str);
+}
+
+/**
+ * Draws a sprite into a canvas, clipped to it.
+ *
+ * @param cv
+ * @param row Row of the sprite's anchor.
+ * @param col Column of the sprite's anchor.
+ * @param sprite
+ */
+void put_sprite(canvas *cv, int row, int col,
+		const sprite_cell sprite[SPRITE_CELLS]) {
+	int i;
+
+	for (i = 0; i < SPRITE_CELLS; i++)
+		put_ch(cv, row + sprite[i].row, col + sprite[i].col, sprite[i].ch);
+}
+
+/**
+ * Formats the score display again, if the score or best score changed since
+ * it was last formatted. Scores only change when a pipe is passed or a game
+ * ends, so most frames reuse the cached text.
+ *
+ * @param g
+ */
+void hud_refresh(game *g) {
+	if (g->score == g->hud_score && g->best_score == g->hud_best)
+		return;
+	g->hud_len = snprintf(g->hud, HUD_SIZE, " Score: %d  Best: %d",
+			g->score, g->best_score);
+	g->hud_score = g->score;
+	g->hud_best = g->best_score;
+}
+
+/**
+ * "Moving" floor and ceiling are written into the canvas, copied out of its
+ * precomputed 'stripes' rather than drawn char by char. Cells between the
+ * chars are blanked.
+ *
+ * @param cv
+ * @param g The game, for the width of the score display.
+ * @param ceiling_row
+ * @param floor_row
+ * @param ch Char to use for the ceiling and floor.
+ * @param spacing Between chars in the floor and ceiling
+ * @param col_start Stagger the beginning of the floor and ceiling chars
+ * by this much
+ */
+void draw_floor_and_ceiling(canvas *cv, const game *g, int ceiling_row,
+		int floor_row, char ch, int spacing, int col_start) {
+	const char *row;
+	int i, floor_len, ceiling_len;
+
+	assert(spacing > 0 && spacing <= MAX_STRIPE_SPACING);
+	if (ch != cv->stripe_ch || spacing != cv->stripe_spacing) {
+		for (i = 0; i < sizeof(cv->stripes); i++)
+			cv->stripes[i] = i % spacing ? ' ' : ch;
+		cv->stripe_ch = ch;
+		cv->stripe_spacing = spacing;
+	}
+
+	// Column i shows stripes[i + offset], which is 'ch' when i is
+	// 'col_start' more than a multiple of 'spacing'.
+	row = cv->stripes + (spacing - col_start % spacing) % spacing;
+
+	// The ceiling stops short of the score; neither reaches the last column.
+	floor_len = g->cols - 1 < cv->cols ? g->cols - 1 : cv->cols;
+	ceiling_len = hud_col(g);
+	if (ceiling_len > floor_len)
+		ceiling_len = floor_len;
+	if (ceiling_row >= 0 && ceiling_row < cv->rows && ceiling_len > 0)
+		memcpy(cv->cells + ceiling_row * cv->cols, row, ceiling_len);
+	if (floor_row >= 0 && floor_row < cv->rows && floor_len > 0)
+		memcpy(cv->cells + floor_row * cv->cols, row, floor_len);
+}
+
+/**
+ * Seeds a xoshiro256** generator. The state is filled from splitmix64, as the
+ * xoshiro authors recommend, so that nearby seeds give unrelated streams.
+ *
+ * @param[out] r
+ * @param seed
+ */
+void rng_seed(rng *r, uint64_t seed) {
+	int i;
+	for (i = 0; i < 4; i++)
+		r->s[i] = counter_random(seed, i);
+}
+
+/**
+ * Gets the opening height of the n-th pipe of a game played in counter mode,
+ * in constant time.
+ *
+ * @param seed The game's seed.
+ * @param n Zero-based pipe number, counting the two starting pipes and every
+ * pipe that wrapped since.
+ *
+ * @return Fraction of the window height in [0.25, 0.75).
+ */
+float pipe_opening_height(uint64_t seed, uint64_t n) {
+	return to_opening_height(counter_random(seed, n));
+}
+
+/**
+ * Gets the opening height for the next pipe of a game.
+ *
+ * @param g
+ *
+ * @return Fraction of the window height in [0.25, 0.75).
+ */
+float random_opening_height(game *g) {
+	uint64_t n = g->pipes_drawn++;
+	return g->counter_rng ? pipe_opening_height(g->seed, n) :
+			to_opening_height(rng_next(&g->rng));
+}
+
+/**
+ * Gets the row number of the top or bottom of the opening in the given pipe.
+ *
+ * @param p The pipe obstacle.
+ * @param rows Number of rows in the world.
+ * @param top Should be 1 for the top, 0 for the bottom.
+ *
+ * @return Row number.
+ */
+int get_orow(vpipe p, int rows, int top) {
+	return p.opening_height * (rows - 1) -
+			(top ? 1 : -1) * OPENING_WIDTH / 2;
+}
+
+/**
+ * Caches where the given pipe's caps are drawn, for after its opening or the
+ * height of the world changed.
+ *
+ * @param p
+ * @param rows Number of rows in the world.
+ */
+void pipe_template(vpipe *p, int rows) {
+	p->top_cap = get_orow(*p, rows, 1);
+	p->bottom_cap = get_orow(*p, rows, 0);
+}
+
+/**
+ * Updates the pipe centers and opening heights for each new frame. If the
+ * leftmost pipe is sufficiently far off-screen to the left the center is
+ * wrapped around to the right, at which time the opening height is changed
+ * and the pipe becomes the rightmost one.
+ *
+ * @param g The game the pipes belong to.
+ */
+void pipes_refresh(game *g) {
+	vpipe *p = &g->pipes[g->first_pipe];
+	int i;
+
+	// If pipe exits screen on the left then wrap it to the right side of the
+	// screen, exactly a period along so its phase stays the same. Only the
+	// leftmost pipe can have gone that far, though after a resize squeezed
+	// two pipes together the second goes a tick later.
+	if(p->center + PIPE_RADIUS < 0) {
+		p->center += g->period;
+		if (++g->first_pipe == g->num_pipes)
+			g->first_pipe = 0;
+
+		// Get an opening height fraction.
+		p->opening_height = random_opening_height(g);
+		pipe_template(p, g->rows);
+		g->score++;
+	}
+	for (i = 0; i < g->num_pipes; i++)
+		g->pipes[i].center--;
+	if (++g->scroll == g->period)
+		g->scroll = 0;
+}
+
+/**
+ * Rebuilds the phase index of the pipes, for after they have been placed or
+ * moved other than by scrolling. Every phase that a pipe's crash zone
+ * (within PIPE_RADIUS + 1 of its center) covers is marked with the pipe, or
+ * as crowded if a pipe already claimed it, which only happens in very narrow
+ * worlds.
+ *
+ * @param g
+ */
+void index_pipes(game *g) {
+	int i, d, ph;
+
+	g->period = g->cols + 2 * PIPE_RADIUS + 1;
+	g->scroll = 0;
+	assert(g->period <= MAX_PERIOD);
+	memset(g->pipe_at, NO_PIPE, g->period);
+	for (i = 0; i < g->num_pipes; i++) {
+		for (d = -PIPE_RADIUS - 1; d <= PIPE_RADIUS + 1; d++) {
+			ph = (g->pipes[i].center + d) % g->period;
+			if (ph < 0)
+				ph += g->period;
+			g->pipe_at[ph] = g->pipe_at[ph] == NO_PIPE ? i : PIPES_CROWDED;
+		}
+	}
+}
+
+/**
+ * Draws the given pipe on the canvas using 'vch' as the character for the
+ * vertical part of the pipe and 'hch' as the character for the horizontal
+ * part.
+ *
+ * @param cv
+ * @param g The game the pipe belongs to, for the size of the world.
+ * @param p
+ * @param vch Character for vertical part of pipe
+ * @param hcht Character for horizontal part of top pipe
+ * @param hchb Character for horizontal part of lower pipe
+ * @param ceiling_row Start the pipe just below this
+ * @param floor_row Star the pipe jut above this
+ */
+void draw_pipe(canvas *cv, const game *g, vpipe p, char vch, char hcht,
+		char hchb, int ceiling_row, int floor_row) {
+	int left = p.center - PIPE_RADIUS, right = p.center + PIPE_RADIUS;
+	int top = p.top_cap > ceiling_row + 1 ? p.top_cap : ceiling_row + 1;
+	int bottom = p.bottom_cap < floor_row - 1 ? p.bottom_cap : floor_row - 1;
+	char *cells = cv->cells;
+	int rows = cv->rows, cols = cv->cols;
+	int from, to, r;
+
+	// Clip once: the pipe shows in columns [from, to), up to but excluding
+	// the world's last column.
+	from = left > 0 ? left : 0;
+	to = right + 1 < g->cols - 1 ? right + 1 : g->cols - 1;
+	if (to > cols)
+		to = cols;
+	if (from >= to)
+		return;
+
+	// Vertical part of upper half of pipe, then its cap.
+	for (r = ceiling_row + 1; r < top && r < rows; r++) {
+		if (left == from)
+			cells[r * cols + left] = vch;
+		if (right < to)
+			cells[r * cols + right] = vch;
+	}
+	if (top < rows)
+		memset(cells + top * cols + from, hcht, to - from);
+
+	// Vertical part of lower half of pipe, then its cap.
+	for (r = floor_row - 1 < rows ? floor_row - 1 : rows - 1;
+			r > bottom; r--) {
+		if (left == from)
+			cells[r * cols + left] = vch;
+		if (right < to)
+			cells[r * cols + right] = vch;
+	}
+	if (bottom < rows)
+		memset(cells + bottom * cols + from, hchb, to - from);
+}
+
+/**
+ * Puts Flappy at the start of a new arc from the given row, as if the up
+ * arrow was just pressed there.
+ *
+ * @param[out] f Flappy!
+ * @param row
+ */
+void flappy_launch(flappy *f, int row) {
+	f->y = row * ROW_SCALE;
+	f->row = row;
+	f->t = 0;
+
+	// Moving from t to t + 1 along y = y0 + V0 * t + GRAV * t^2 / 2 covers
+	// V0 + GRAV * t + GRAV / 2, so that's the first step and each step after
+	// it is GRAV longer.
+	f->v = V0 + GRAV / 2;
+}
+
+/**
+ * Returns true if Flappy crashed into a pipe.
+ *
+ * @param f Flappy!
+ * @param p The vertical pipe obstacle.
+ * @param rows Number of rows in the world.
+ *
+ * @return 1 if Flappy crashed, 0 otherwise.
+ */
+int crashed_into_pipe(flappy f, vpipe p, int rows) {
+	if (FLAPPY_COL >= p.center - PIPE_RADIUS - 1 &&
+			FLAPPY_COL <= p.center + PIPE_RADIUS + 1) {
+
+		if (f.row >= get_orow(p, rows, 1)  + 1 &&
+				f.row <= get_orow(p, rows, 0) - 1) {
+			return 0;
+		}
+		else {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Folds the score of the game that just ended into the best score and zeroes
+ * the score for the next game.
+ *
+ * @param g
+ */
+void end_game(game *g) {
+	if (g->score > g->best_score)
+		g->best_score = g->score;
+	g->score = 0;
+}
+
+/**
+ * Checks whether Flappy crashed into the ceiling, the floor or a pipe.
+ *
+ * @param g
+ *
+ * @return What Flappy crashed into, or ALIVE.
+ */
+death flappy_crashed(const game *g) {
+	int h = get_flappy_position(g->f);
+	int i;
+	vpipe p;
+
+	// If Flappy crashed into the ceiling or the floor...
+	if (h <= 0)
+		return DIED_CEILING;
+	if (h >= g->rows - 1)
+		return DIED_FLOOR;
+
+	// If Flappy crashed into a pipe... Phases repeat every 'period' columns,
+	// so the pipe found could be a whole period away, but then
+	// crashed_into_pipe() sees that it's not at Flappy's column.
+	i = g->pipe_at[(FLAPPY_COL + g->scroll) % g->period];
+	if (i == NO_PIPE)
+		return ALIVE;
+	if (i != PIPES_CROWDED)
+		return crashed_into_pipe(g->f, g->pipes[i], g->rows) ?
+				DIED_PIPE : ALIVE;
+
+	// Only pipes from the next one on that reach back to Flappy's column
+	// need checking.
+	for (i = next_pipe(g); i < g->num_pipes; i++) {
+		p = g->pipes[pipe_index(g, i)];
+		if (p.center - PIPE_RADIUS - 1 > FLAPPY_COL)
+			break;
+		if (crashed_into_pipe(g->f, p, g->rows))
+			return DIED_PIPE;
+	}
+	return ALIVE;
+}
+
+/**
+ * Draws Flappy on the canvas. Assumes Flappy is still alive, i.e. that
+ * flappy_crashed() returned 0 for this tick.
+ *
+ * @param cv
+ * @param g The game with Flappy the bird in it!
+ */
+void draw_flappy(canvas *cv, const game *g) {
+	flappy f = g->f;
+	pose p;
+
+	// If going down, don't flap. If going up, flap!
+	if (flappy_falling(f))
+		p = POSE_FALLING;
+	else
+		p = g->frame % 6 < 3 ? POSE_WINGS_DOWN : POSE_WINGS_UP;
+	put_sprite(cv, get_flappy_position(f), FLAPPY_COL, FLAPPY_SPRITES[p]);
+}
+
+/**
+ * Gets the number of pipes a game of the given width starts with. A pipe
+ * comes back around every cols + 2 * PIPE_RADIUS + 1 ticks, so that's as
+ * many pipes as fit over that period at PIPE_SPACING, but at least two.
+ *
+ * @param cols
+ *
+ * @return Number of pipes, at most MAX_PIPES.
+ */
+int pipe_count(int cols) {
+	int n = (cols + 2 * PIPE_RADIUS + 1) / PIPE_SPACING;
+	return n < 2 ? 2 : (n > MAX_PIPES ? MAX_PIPES : n);
+}
+
+/**
+ * Gets the column a pipe starts a game in: the pipe_count() pipes are spread
+ * evenly over one period, starting FIRST_PIPE_LEAD columns past the right
+ * edge. Batched games start their pipes here too.
+ *
+ * @param cols Width of the world.
+ * @param i Position of the pipe from the left.
+ *
+ * @return Column of the pipe's center.
+ */
+int pipe_start(int cols, int i) {
+	int n = pipe_count(cols);
+	return cols - 1 + FIRST_PIPE_LEAD + (i * (cols + 2 * PIPE_RADIUS + 1) +
+			n - 1) / n;
+}
+
+/**
+ * Starts a new game: puts the pipes just out of view on the right and Flappy
+ * in the middle of the screen. The score and best score carry over.
+ *
+ * @param g
+ */
+void reset_world(game *g) {
+	int i;
+
+	g->num_pipes = pipe_count(g->cols);
+	g->first_pipe = 0;
+	for (i = 0; i < g->num_pipes; i++) {
+		g->pipes[i].center = pipe_start(g->cols, i);
+		g->pipes[i].opening_height = random_opening_height(g);
+		pipe_template(&g->pipes[i], g->rows);
+	}
+	index_pipes(g);
+
+	flappy_launch(&g->f, g->rows / 2);
+	g->ticks = 0;
+}
+
+/**
+ * Initializes a game context from scratch and starts its first game.
+ *
+ * @param[out] g
+ * @param seed Seed for the pipe openings. Equal seeds give equal games.
+ * @param counter_rng If nonzero, draw pipe openings in counter mode.
+ * @param rows Size of the world, e.g. NUM_ROWS x NUM_COLS, at least
+ * MIN_ROWS x MIN_COLS; a smaller size is brought up to that.
+ * @param cols At most MAX_COLS; wider is cut down to that.
+ */
+void game_init(game *g, uint64_t seed, int counter_rng, int rows, int cols) {
+	g->rows = rows > MIN_ROWS ? rows : MIN_ROWS;
+	g->cols = cols > MIN_COLS ? cols : MIN_COLS;
+	if (g->cols > MAX_COLS)
+		g->cols = MAX_COLS;
+	g->frame = 0;
+	g->score = 0;
+	g->best_score = 0;
+	g->hud_score = -1;
+	hud_refresh(g);
+	g->seed = seed;
+	g->pipes_drawn = 0;
+	g->counter_rng = counter_rng;
+	rng_seed(&g->rng, seed);
+	reset_world(g);
+}
+
+/**
+ * Resizes the world in the middle of a game. Everything keeps its place
+ * relative to the size of the world: pipe openings are already fractions of
+ * its height, Flappy's height is scaled with it, and the pipes ahead of
+ * Flappy have their distances from his column scaled with the width, which
+ * also spreads them out to suit it. Pipes he has passed stay where they are.
+ * The pipes stay in order and less than a period from the leftmost one to
+ * the rightmost, which index_pipes() relies on. The number of pipes is
+ * adjusted to the new width when the next game starts. The size is clamped
+ * as for game_init().
+ *
+ * @param g
+ * @param rows
+ * @param cols
+ */
+void game_resize(game *g, int rows, int cols) {
+	flappy *f = &g->f;
+	int first = g->pipes[g->first_pipe].center;
+	int pivot = first < FLAPPY_COL ? FLAPPY_COL : first;
+	int i, c, old_room, new_room;
+
+	if (rows < MIN_ROWS)
+		rows = MIN_ROWS;
+	if (cols < MIN_COLS)
+		cols = MIN_COLS;
+	if (cols > MAX_COLS)
+		cols = MAX_COLS;
+
+	f->y = (long long) f->y * (rows - 1) / (g->rows - 1);
+	f->row = f->y / ROW_SCALE;
+
+	// The rooms are how far past the pivot a pipe can be before it's a
+	// period from the leftmost one, which stays put. Pipes in that room are
+	// scaled from one room to the other, so they stay in it. MIN_COLS keeps
+	// both rooms positive.
+	old_room = first + g->period - pivot;
+	new_room = first + cols + 2 * PIPE_RADIUS + 1 - pivot;
+	for (i = 0; i < g->num_pipes; i++) {
+		c = g->pipes[i].center;
+		if (c > pivot)
+			g->pipes[i].center = pivot +
+					(long long) (c - pivot) * new_room / old_room;
+	}
+	g->rows = rows;
+	g->cols = cols;
+	for (i = 0; i < g->num_pipes; i++)
+		pipe_template(&g->pipes[i], rows);
+	index_pipes(g);
+}
+
+/**
+ * Advances the world by one fixed physics tick: moves Flappy along his
+ * parabola and scrolls the pipes. Touches no terminal state, so the same
+ * code drives both the interactive and the headless game.
+ *
+ * @param g
+ * @param flap 1 if Flappy should get a boost this tick.
+ *
+ * @return What Flappy crashed into during this tick, or ALIVE.
+ */
+death physics_tick(game *g, int flap) {
+	flappy *f = &g->f;
+
+	if (flap) // Give Flappy a boost!
+		flappy_launch(f, f->row);
+	else // Let Flappy fall along his parabola.
+		flappy_fall(f);
+
+	pipes_refresh(g);
+	g->frame++;
+	g->ticks++;
+
+	return flappy_crashed(g);
+}
+
+/**
+ * Chooses whether Flappy should flap, without a human. Aims for the lower
+ * part of the opening in the next pipe and flaps only when falling below
+ * it, since a flap carries Flappy about 2.5 rows up.
+ *
+ * @param g
+ *
+ * @return 1 to flap, 0 otherwise.
+ */
+int autopilot_flap(const game *g) {
+	vpipe next = g->pipes[pipe_index(g, next_pipe(g))];
+
+	return V0 + GRAV * g->f.t >= 0 &&
+			g->f.row >= get_orow(next, g->rows, 0) - 2;
+}
+
+/**
+ * Checks whether Flappy crashes k ticks from now, against the pipes in a
+ * lookahead, which by then have moved k columns left.
+ *
+ * @param s
+ * @param f Flappy k ticks from now.
+ * @param k
+ *
+ * @return 1 if Flappy crashed, 0 otherwise.
+ */
+static int lookahead_crashed(const lookahead *s, flappy f, int k) {
+	int h = get_flappy_position(f), i;
+	vpipe p;
+
+	if (h <= 0 || h >= s->rows - 1)
+		return 1;
+	for (i = 0; i < s->num_pipes; i++) {
+		p = s->pipes[i];
+		p.center -= k;
+		if (crashed_into_pipe(f, p, s->rows))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Searches for a way for Flappy to stay alive until the search horizon.
+ * Not flapping is tried first, so the way found flaps as late as it can.
+ *
+ * @param s
+ * @param f Flappy k ticks from now, still alive.
+ * @param row0 Row of Flappy's last flap, or -1 if that was before now.
+ * @param k
+ *
+ * @return 1 if Flappy can survive, 0 if he's doomed.
+ */
+static int lookahead_survives(lookahead *s, flappy f, int row0, int k) {
+	uint16_t *m;
+	flappy next;
+	int ok;
+
+	if (k == SEARCH_HORIZON)
+		return 1;
+	m = &s->memo[row0 + 1][row0 < 0 ? 0 : f.t][k];
+	if (*m >> 1 == s->stamp)
+		return *m & 1;
+
+	next = f;
+	flappy_fall(&next);
+	ok = !lookahead_crashed(s, next, k + 1) &&
+			lookahead_survives(s, next, row0, k + 1);
+	if (!ok) {
+		next = f;
+		flappy_launch(&next, f.row);
+		ok = !lookahead_crashed(s, next, k + 1) &&
+				lookahead_survives(s, next, f.row, k + 1);
+	}
+	*m = (uint16_t) (s->stamp << 1 | ok);
+	return ok;
+}
+
+/**
+ * Creates the key to the lookahead scratch spaces, once per process.
+ */
+static void search_key_create(void) {
+	search_key_made = !pthread_key_create(&search_key, free);
+}
+
+/**
+ * Gets the calling thread's scratch space for lookahead_flap(), allocating
+ * it if the thread hasn't had one yet.
+ *
+ * @return The scratch space, or NULL if it couldn't be allocated.
+ */
+static lookahead *thread_search(void) {
+	lookahead *s;
+
+	pthread_once(&search_once, search_key_create);
+	if (!search_key_made)
+		return NULL;
+	if ((s = pthread_getspecific(search_key)))
+		return s;
+	if (!(s = calloc(1, sizeof(lookahead))))
+		return NULL;
+	if (pthread_setspecific(search_key, s)) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+/**
+ * Chooses whether Flappy should flap by simulating every way the next
+ * SEARCH_HORIZON ticks could go: flaps only if not flapping now dooms him.
+ * Falls back to autopilot_flap() in worlds too tall to search, or if there's
+ * no memory to search with.
+ *
+ * @param g
+ *
+ * @return 1 to flap, 0 otherwise.
+ */
+int lookahead_flap(const game *g) {
+	flappy next = g->f;
+	lookahead *s;
+	vpipe p;
+	int i;
+
+	if (g->rows > SEARCH_ROWS || !(s = thread_search()))
+		return autopilot_flap(g);
+	if (++s->stamp == 1 << 15) {
+		memset(s->memo, 0, sizeof(s->memo));
+		s->stamp = 1;
+	}
+
+	// Pipes behind Flappy are out of the way for good, and the ones that
+	// will wrap around by the horizon don't have their openings yet.
+	s->rows = g->rows;
+	s->num_pipes = 0;
+	for (i = next_pipe(g); i < g->num_pipes; i++) {
+		p = g->pipes[pipe_index(g, i)];
+		if (p.center - PIPE_RADIUS - 1 > FLAPPY_COL + SEARCH_HORIZON)
+			break;
+		s->pipes[s->num_pipes++] = p;
+	}
+
+	flappy_fall(&next);
+	return lookahead_crashed(s, next, 1) ||
+			!lookahead_survives(s, next, -1, 1);
+}
+
+/**
+ * Draws the current state of the world on a canvas. The canvas is cleared
+ * and every cell drawn again, so this takes time in proportion to the size
+ * of the world however little changed; it's sending the canvas to a
+ * terminal, e.g. with fb_flush() in driver.c, that's limited to what did.
+ *
+ * @param cv
+ * @param g
+ */
+void compose_frame(canvas *cv, game *g) {
+	int i;
+
+	hud_refresh(g);
+	canvas_clear(cv);
+
+	// Print "moving" floor and ceiling
+	draw_floor_and_ceiling(cv, g, 0, g->rows - 1, '/', 2, g->frame % 2);
+
+	// Draw the pipes and Flappy.
+	for (i = 0; i < g->num_pipes; i++)
+		draw_pipe(cv, g, g->pipes[i], '|', '=', '=', 0, g->rows - 1);
+	draw_flappy(cv, g);
+
+	put_str(cv, 0, hud_col(g), g->hud);
+}
+
+const char *ab_preset(void) {
+	return PRESET_NAME;
+}
+
+int ab_reset_preset(ab_game *g, uint64_t seed, const char *preset) {
+	if (strcmp(preset, PRESET_NAME))
+		return -1;
+	game_init(g, seed, 1, NUM_ROWS, NUM_COLS);
+	return 0;
+}
+
+death ab_step(ab_game *g, int action) {
+	return physics_tick(g, action);
+}
+
+death ab_play(ab_game *g, policy_fn policy, int max_ticks) {
+	death d = ALIVE;
+
+	while (d == ALIVE && g->ticks < max_ticks)
+		d = physics_tick(g, policy(g));
+	return d;
+}
+
+void ab_render(ab_game *g, char *buffer) {
+	canvas cv;
+
+	canvas_init(&cv, buffer, g->rows, g->cols);
+	compose_frame(&cv, g);
+}
@@ -0,0 +1,540 @@
+/**
+ * @file
+ * @author Hamik Mukelyan
+ *
+ * libasciibird: the game itself, without a terminal. A game is a plain
+ * struct; stepping it allocates nothing and does no I/O, and drawing it
+ * writes chars into a canvas that the caller owns. The terminal frontend,
+ * the headless runners, the server and the benchmarks in driver.c are all
+ * built on it.
+ * ab_reset(), ab_step() and ab_render() are the stable entry points; the
+ * rest is exposed for those clients.
+ *
+ * The constants and inline helpers here come from the preset in config.h
+ * that the client is compiled with, and the library's from the one it was
+ * built with. ab_reset() refuses to start a game if the two differ.
+ */
+
+#ifndef ASCIIBIRD_H
+#define ASCIIBIRD_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+//-------------------------------- Definitions --------------------------------
+
+/** Worlds are at most this wide, however wide the terminal is. */
+#define MAX_COLS 1024
+
+/**
+ * Longest wrap period of the pipes, MAX_COLS + 2 * PIPE_RADIUS + 1, with room
+ * to spare.
+ */
+#define MAX_PERIOD (MAX_COLS + 16)
+
+/** Capacity of a game's ring of pipes, enough for a MAX_COLS wide world. */
+#define MAX_PIPES 32
+
+/** Room for the score display, with any scores that fit in an int. */
+#define HUD_SIZE 48
+
+/** Widest spacing between the chars of the floor and ceiling. */
+#define MAX_STRIPE_SPACING 8
+
+/** Number of cells in each of Flappy's sprites. */
+#define SPRITE_CELLS 5
+
+/**
+ * Represents a vertical pipe through which Flappy The Bird is supposed to fly.
+ */
+typedef struct vpipe {
+
+	/*
+	 * The height of the opening of the pipe as a fraction of the height of the
+	 * console window.
+	 */
+	float opening_height;
+
+	/*
+	 * Center of the pipe is at this column number (e.g. somewhere in [0, 79]).
+	 * When the center + radius is negative then the pipe's center is rolled
+	 * over to somewhere > the number of columns and the opening height is
+	 * changed.
+	 */
+	int center;
+
+	/*
+	 * Rows of the caps at the top and bottom of the opening, cached by
+	 * pipe_template() whenever the opening or the height of the world
+	 * changes, so drawing needn't work them out every frame.
+	 */
+	int top_cap, bottom_cap;
+} vpipe;
+
+/** Ways in which a game can end. */
+typedef enum death {
+	ALIVE = 0,
+	DIED_CEILING,
+	DIED_FLOOR,
+	DIED_PIPE
+} death;
+
+/**
+ * Represents Flappy the Bird. Flappy's height is fixed point, in units of
+ * 1/ROW_SCALE rows, and is advanced incrementally once per tick, so the arc is
+ * exact and the same on every compiler and architecture.
+ */
+typedef struct flappy {
+	/* Height of Flappy the Bird, in 1/ROW_SCALE rows. */
+	int y;
+
+	/* Distance Flappy will move during the next tick, in 1/ROW_SCALE rows. */
+	int v;
+
+	/* Row Flappy is in, i.e. y / ROW_SCALE, updated along with 'y'. */
+	int row;
+
+	/* Time since last up arrow pressed. */
+	int t;
+} flappy;
+
+/**
+ * State of a xoshiro256** pseudo-random number generator. Each game owns one,
+ * so games never share or contend on a generator.
+ */
+typedef struct rng {
+	uint64_t s[4];
+} rng;
+
+/**
+ * Everything about one game in progress. Nothing in the simulation touches
+ * global state, so any number of these can be stepped on different threads
+ * without locking.
+ */
+typedef struct game {
+	/* Size of the world, which is the terminal's size in interactive play. */
+	int rows, cols;
+
+	/* Frame number. */
+	int frame;
+
+	/* Number of ticks since the current game started. */
+	int ticks;
+
+	/* Number of pipes that have been passed. */
+	int score;
+
+	/* Best score so far. */
+	int best_score;
+
+	/*
+	 * The score display, 'hud_len' chars, as last formatted by hud_refresh()
+	 * for a score of 'hud_score' and a best of 'hud_best'.
+	 */
+	char hud[HUD_SIZE];
+	int hud_len, hud_score, hud_best;
+
+	/*
+	 * The vertical pipe obstacles, a ring of 'num_pipes' pipes ordered left
+	 * to right starting at index 'first_pipe'. A pipe that leaves the screen
+	 * on the left is recycled in place as the rightmost one by advancing
+	 * 'first_pipe'.
+	 */
+	vpipe pipes[MAX_PIPES];
+	int first_pipe, num_pipes;
+
+	/*
+	 * A pipe moves left one column per tick and wraps around by 'period'
+	 * columns, so (column + scroll) % period, its phase, never changes as
+	 * long as 'scroll' counts ticks mod 'period'. 'pipe_at' maps each phase
+	 * to the index in 'pipes' of the pipe that can hit Flappy there, so
+	 * finding the pipe at FLAPPY_COL is one lookup. See index_pipes().
+	 */
+	int period, scroll;
+	signed char pipe_at[MAX_PERIOD];
+
+	/* Flappy the Bird. */
+	flappy f;
+
+	/* Seed the game was started with. */
+	uint64_t seed;
+
+	/* Number of pipe openings drawn so far. */
+	uint64_t pipes_drawn;
+
+	/*
+	 * If nonzero, the opening of the n-th pipe is a pure function of seed and
+	 * n (see counter_random()) instead of the next value from 'rng'.
+	 */
+	int counter_rng;
+
+	/* Generator for the pipe openings when not in counter mode. */
+	rng rng;
+} game;
+
+/** A cell of a sprite, relative to the sprite's anchor. */
+typedef struct sprite_cell {
+	signed char row, col;
+	char ch;
+} sprite_cell;
+
+/** Flappy's poses, each drawn from a sprite in FLAPPY_SPRITES. */
+typedef enum pose {
+	POSE_FALLING,
+	POSE_WINGS_DOWN,
+	POSE_WINGS_UP,
+	NUM_POSES
+} pose;
+
+/**
+ * A grid of chars that frames are drawn into, such as a copy of the screen.
+ * Drawing touches nothing but the game and the canvas, so different threads
+ * can draw on different canvases at once.
+ */
+typedef struct canvas {
+	/* The chars, row-major, 'rows' x 'cols', owned by the canvas's creator. */
+	char *cells;
+	int rows, cols;
+
+	/*
+	 * The floor and ceiling: 'stripe_ch' in every 'stripe_spacing'-th
+	 * column, starting with column 0, and blanks in between. Each stagger of
+	 * the pattern is a window into it starting at a different offset.
+	 * Rebuilt only if draw_floor_and_ceiling() is asked for a different
+	 * pattern.
+	 */
+	char stripes[MAX_COLS + MAX_STRIPE_SPACING];
+	char stripe_ch;
+	int stripe_spacing;
+} canvas;
+
+/**
+ * Chooses whether Flappy should flap on the next tick.
+ *
+ * @param g
+ *
+ * @return 1 to flap, 0 otherwise.
+ */
+typedef int (*policy_fn)(const game *g);
+
+//----------------------------- Global Constants ------------------------------
+
+/** Flappy's height is kept in units of 1/ROW_SCALE rows. */
+static const int ROW_SCALE = 40;
+
+/**
+ * Gravitational acceleration, in 1/ROW_SCALE rows per tick per tick, e.g.
+ * 0.05 rows per tick per tick for 2. Must be even so the arc stays integral.
+ * This and the other tunables below come from the preset in config.h.
+ */
+static const int GRAV = CONFIG_GRAV;
+
+/** Initial velocity with up arrow press, in 1/ROW_SCALE rows per tick. */
+static const int V0 = CONFIG_V0;
+
+/**
+ * Number of rows in the world when there's no terminal to size it to, as in
+ * headless games.
+ */
+static const int NUM_ROWS = 24;
+
+/** Number of columns in the world when there's no terminal to size it to. */
+static const int NUM_COLS = 80;
+
+/**
+ * Worlds are at least this tall, room for the ceiling, the floor and Flappy
+ * between them, however short the terminal is.
+ */
+static const int MIN_ROWS = 3;
+
+/** Radius of each vertical pipe. */
+static const int PIPE_RADIUS = CONFIG_PIPE_RADIUS;
+
+/** Width of the opening in each pipe. */
+static const int OPENING_WIDTH = CONFIG_OPENING_WIDTH;
+
+/** Flappy stays in this column. */
+static const int FLAPPY_COL = CONFIG_FLAPPY_COL;
+
+/** Worlds are at least this wide, so Flappy's column is in them. */
+static const int MIN_COLS = CONFIG_FLAPPY_COL + 1;
+
+/**
+ * Average number of columns between pipes. A world gets as many pipes as fit
+ * at this spacing, but at least two.
+ */
+static const int PIPE_SPACING = 43;
+
+/** The first pipe of a game starts this many columns past the right edge. */
+static const int FIRST_PIPE_LEAD = 15;
+
+/** In 'pipe_at', no pipe can hit Flappy at this phase. */
+static const int NO_PIPE = -1;
+
+/** In 'pipe_at', more than one pipe might hit Flappy at this phase. */
+static const int PIPES_CROWDED = -2;
+
+/** Aiming for this many frames per second. */
+static const float TARGET_FPS = CONFIG_TARGET_FPS;
+
+/**
+ * The score display ends this many columns left of the right edge of the
+ * world, and reaches further left the more digits the scores have.
+ */
+static const int HUD_RIGHT_MARGIN = 2;
+
+/** Increment of the splitmix64 generator, 2^64 divided by the golden ratio. */
+static const uint64_t SPLITMIX_GAMMA = 0x9e3779b97f4a7c15ULL;
+
+//--------------------------------- Functions ---------------------------------
+
+/**
+ * Gets the column the score display starts in, which is as far left of the
+ * right edge as the display is wide.
+ *
+ * @param g
+ *
+ * @return Column number, negative if the world is too narrow for the display.
+ */
+static inline int hud_col(const game *g) {
+	return g->cols - HUD_RIGHT_MARGIN - g->hud_len;
+}
+
+/**
+ * The splitmix64 output function, which scrambles all 64 bits of its input.
+ *
+ * @param z
+ *
+ * @return Scrambled z.
+ */
+static inline uint64_t mix64(uint64_t z) {
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * Gets the n-th number in the splitmix64 sequence started from 'seed',
+ * without generating the ones before it.
+ *
+ * @param seed
+ * @param n Zero-based position in the sequence.
+ *
+ * @return A pseudo-random 64-bit number.
+ */
+static inline uint64_t counter_random(uint64_t seed, uint64_t n) {
+	return mix64(seed + (n + 1) * SPLITMIX_GAMMA);
+}
+
+/**
+ * Draws the next number from a xoshiro256** generator.
+ *
+ * @param r
+ *
+ * @return A pseudo-random 64-bit number.
+ */
+static inline uint64_t rng_next(rng *r) {
+	uint64_t *s = r->s;
+	uint64_t x = s[1] * 5;
+	uint64_t result = ((x << 7) | (x >> 57)) * 9;
+	uint64_t t = s[1] << 17;
+
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = (s[3] << 45) | (s[3] >> 19);
+	return result;
+}
+
+/**
+ * Turns a random number into a pipe opening height, as a fraction of the
+ * window height.
+ *
+ * @param x 64 random bits.
+ *
+ * @return Fraction in [0.25, 0.75).
+ */
+static inline float to_opening_height(uint64_t x) {
+	// The top 24 bits exactly fill a float's mantissa.
+	return (x >> 40) * (1.0f / (1 << 24)) * 0.5f + 0.25f;
+}
+
+/**
+ * Gets the i-th pipe from the left.
+ *
+ * @param g
+ * @param i In [0, g->num_pipes).
+ *
+ * @return Index of the pipe in g->pipes.
+ */
+static inline int pipe_index(const game *g, int i) {
+	i += g->first_pipe;
+	return i < g->num_pipes ? i : i - g->num_pipes;
+}
+
+/**
+ * Gets the leftmost pipe that Flappy hasn't cleared yet. It's the only one
+ * Flappy can crash into unless the world has been squeezed narrow.
+ *
+ * @param g
+ *
+ * @return Position of the pipe from the left, as for pipe_index().
+ */
+static inline int next_pipe(const game *g) {
+	int i;
+	for (i = 0; i < g->num_pipes - 1; i++)
+		if (g->pipes[pipe_index(g, i)].center + PIPE_RADIUS + 1 >= FLAPPY_COL)
+			break;
+	return i;
+}
+
+/**
+ * Get Flappy's height along its parabolic arc.
+ *
+ * @param f Flappy!
+ *
+ * @return height as a row count
+ */
+static inline int get_flappy_position(flappy f) {
+	return f.row;
+}
+
+/**
+ * Moves Flappy one tick along his arc.
+ *
+ * @param f Flappy!
+ */
+static inline void flappy_fall(flappy *f) {
+	f->y += f->v;
+	f->v += GRAV;
+	f->t++;
+
+	// Division truncates toward zero, same as converting the old floating
+	// point height to an int did.
+	f->row = f->y / ROW_SCALE;
+}
+
+/**
+ * Checks whether Flappy is on the way down.
+ *
+ * @param f Flappy!
+ *
+ * @return 1 if Flappy's velocity is strictly downward.
+ */
+static inline int flappy_falling(flappy f) {
+	return V0 + GRAV * f.t > 0;
+}
+
+/* Drawing on a canvas. */
+void canvas_init(canvas *cv, char *cells, int rows, int cols);
+void canvas_clear(canvas *cv);
+void put_ch(canvas *cv, int row, int col, char ch);
+void put_str(canvas *cv, int row, int col, const char *str);
+void put_sprite(canvas *cv, int row, int col,
+		const sprite_cell sprite[SPRITE_CELLS]);
+void hud_refresh(game *g);
+void draw_floor_and_ceiling(canvas *cv, const game *g, int ceiling_row,
+		int floor_row, char ch, int spacing, int col_start);
+void draw_pipe(canvas *cv, const game *g, vpipe p, char vch, char hcht,
+		char hchb, int ceiling_row, int floor_row);
+void draw_flappy(canvas *cv, const game *g);
+void compose_frame(canvas *cv, game *g);
+
+/* Pipes and their openings. */
+void rng_seed(rng *r, uint64_t seed);
+float pipe_opening_height(uint64_t seed, uint64_t n);
+float random_opening_height(game *g);
+int get_orow(vpipe p, int rows, int top);
+void pipe_template(vpipe *p, int rows);
+void pipes_refresh(game *g);
+void index_pipes(game *g);
+int pipe_count(int cols);
+int pipe_start(int cols, int i);
+
+/* Flappy and the rules of the game. */
+void flappy_launch(flappy *f, int row);
+int crashed_into_pipe(flappy f, vpipe p, int rows);
+void end_game(game *g);
+death flappy_crashed(const game *g);
+void reset_world(game *g);
+void game_init(game *g, uint64_t seed, int counter_rng, int rows, int cols);
+void game_resize(game *g, int rows, int cols);
+death physics_tick(game *g, int flap);
+
+/* Built-in policies; see policy_fn. */
+int autopilot_flap(const game *g);
+int lookahead_flap(const game *g);
+
+/** A game, as driven through the stable API. */
+typedef game ab_game;
+
+/**
+ * Gets the difficulty preset the library was built with.
+ *
+ * @return Its name, as in PRESET_NAMES.
+ */
+const char *ab_preset(void);
+
+/**
+ * Does the work of ab_reset(), which passes the name of the caller's preset.
+ *
+ * @param g
+ * @param seed
+ * @param preset
+ *
+ * @return 0, or -1 if the library was built with a different preset.
+ */
+int ab_reset_preset(ab_game *g, uint64_t seed, const char *preset);
+
+/**
+ * Starts a new NUM_ROWS x NUM_COLS game on its own storage, with the n-th
+ * pipe's opening depending only on the seed and n. Fails if the library was
+ * built with a different preset than the caller, which would leave the two
+ * disagreeing about the physics and the layout of the world.
+ *
+ * @param g
+ * @param seed
+ *
+ * @return 0, or -1 if the presets differ, in which case g is left alone.
+ */
+static inline int ab_reset(ab_game *g, uint64_t seed) {
+	return ab_reset_preset(g, seed, PRESET_NAME);
+}
+
+/**
+ * Advances a game by one tick.
+ *
+ * @param g
+ * @param action Nonzero to flap.
+ *
+ * @return What Flappy crashed into, or ALIVE.
+ */
+death ab_step(ab_game *g, int action);
+
+/**
+ * Plays a game with a policy at the controls until Flappy crashes or the
+ * game has lasted max_ticks ticks. Loops inside the library, so a client
+ * running many games doesn't pay for a call per tick.
+ *
+ * @param g
+ * @param policy
+ * @param max_ticks
+ *
+ * @return What Flappy crashed into, or ALIVE if the game was called off.
+ */
+death ab_play(ab_game *g, policy_fn policy, int max_ticks);
+
+/**
+ * Draws a game into a buffer of g->rows x g->cols chars, row-major. Touches
+ * nothing but the game and the buffer, so threads can render different games
+ * at once, each into its own buffer.
+ *
+ * @param g
+ * @param buffer
+ */
+void ab_render(ab_game *g, char *buffer);
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * @file
+ * @author Hamik Mukelyan
+ *
+ * Frame rate check for the game server, run by make check against a server
+ * listening on the port it's given. Several players connect at once and
+ * count the frames each one is sent over a fixed time; every one of them
+ * must get close to TARGET_FPS. Nobody flaps, so Flappy soon dies, but the
+ * players keep pressing a key that starts the next game right away. Then
+ * the keys are checked: an up arrow must leave a session open, and ESC q,
+ * as Alt+q is sent, must quit it.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asciibird.h"
+
+//-------------------------------- Definitions --------------------------------
+
+/** Players connected at once. */
+#define CHECK_SESSIONS 8
+
+//----------------------------- Global Constants ------------------------------
+
+/** How long the frames are counted for. */
+static const long long CHECK_NS = 3000000000LL;
+
+/**
+ * Output arriving within this long of the last is taken to be part of the
+ * same frame.
+ */
+static const long long FRAME_GAP_NS = 10000000LL;
+
+/** How often the players press a key. */
+static const int KEY_MS = 5;
+
+/** How long to keep trying to connect while the server starts up. */
+static const int CONNECT_TRIES = 100, CONNECT_WAIT_US = 20000;
+
+/** Fraction of TARGET_FPS every player must get. */
+static const double MIN_FRAME_RATE = 0.9;
+
+/** How long the server gets to act on a key. */
+static const int KEY_WAIT_MS = 500;
+
+//--------------------------------- Functions ---------------------------------
+
+/**
+ * @return Nanoseconds on the monotonic clock.
+ */
+long long check_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Connects to the server on localhost, waiting for it to come up.
+ *
+ * @param port
+ *
+ * @return The socket, or -1 if the server never answered.
+ */
+int check_connect(int port) {
+	struct sockaddr_in addr;
+	int fd, i;
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	for (i = 0; i < CONNECT_TRIES; i++) {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+			return -1;
+		if (!connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+			return fd;
+		close(fd);
+		usleep(CONNECT_WAIT_US);
+	}
+	return -1;
+}
+
+/**
+ * Reads what the server sends until it closes the connection or goes quiet.
+ *
+ * @param fd
+ *
+ * @return 1 if the connection was closed, 0 if not.
+ */
+int check_closed(int fd) {
+	struct pollfd p = { fd, POLLIN, 0 };
+	char buf[4096];
+
+	while (poll(&p, 1, KEY_WAIT_MS) > 0)
+		if (recv(fd, buf, sizeof(buf), 0) <= 0)
+			return 1;
+	return 0;
+}
+
+/**
+ * Presses keys in a session: an up arrow, which must only flap, and then
+ * ESC q, which must quit even though it starts like an escape sequence.
+ *
+ * @param fd
+ *
+ * @return 1 if the session did as it should, 0 if not.
+ */
+int check_keys(int fd) {
+	send(fd, "\033[A", 3, MSG_NOSIGNAL);
+	if (check_closed(fd)) {
+		fprintf(stderr, "server: an up arrow closed the session\n");
+		return 0;
+	}
+	send(fd, "\033q", 2, MSG_NOSIGNAL);
+	if (!check_closed(fd)) {
+		fprintf(stderr, "server: ESC q didn't quit\n");
+		return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	struct pollfd fds[CHECK_SESSIONS];
+	long long last[CHECK_SESSIONS], start, end, now;
+	long frames[CHECK_SESSIONS], fewest, expected;
+	char buf[4096];
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s port\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < CHECK_SESSIONS; i++) {
+		if ((fds[i].fd = check_connect(atoi(argv[1]))) < 0) {
+			fprintf(stderr, "server: can't connect to port %s\n", argv[1]);
+			return EXIT_FAILURE;
+		}
+		fds[i].events = POLLIN;
+		last[i] = 0;
+		frames[i] = -1; // The greeting isn't a frame.
+	}
+
+	start = check_now_ns();
+	end = start + CHECK_NS;
+	while ((now = check_now_ns()) < end) {
+		if (poll(fds, CHECK_SESSIONS, KEY_MS) < 0)
+			return EXIT_FAILURE;
+		now = check_now_ns();
+		for (i = 0; i < CHECK_SESSIONS; i++) {
+			if (!(fds[i].revents & POLLIN))
+				continue;
+			if (recv(fds[i].fd, buf, sizeof(buf), 0) <= 0) {
+				fprintf(stderr, "server: session %d was closed\n", i);
+				return EXIT_FAILURE;
+			}
+			if (now - last[i] > FRAME_GAP_NS)
+				frames[i]++;
+			last[i] = now;
+		}
+		// Starts the next game if this one is over, and does nothing if not.
+		for (i = 0; i < CHECK_SESSIONS; i++)
+			send(fds[i].fd, " ", 1, MSG_NOSIGNAL);
+	}
+
+	fewest = frames[0];
+	for (i = 1; i < CHECK_SESSIONS; i++)
+		if (frames[i] < fewest)
+			fewest = frames[i];
+	expected = (long) (TARGET_FPS * CHECK_NS / 1000000000LL);
+	printf("server: at least %ld frames of %ld for each of %d sessions\n",
+			fewest, expected, CHECK_SESSIONS);
+	if (fewest < MIN_FRAME_RATE * expected || !check_keys(fds[0].fd))
+		return EXIT_FAILURE;
+	printf("server: keys as expected\n");
+	return EXIT_SUCCESS;
+}
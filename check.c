@@ -0,0 +1,115 @@
+/**
+ * @file
+ * @author Hamik Mukelyan
+ *
+ * Consistency checks for libasciibird, run by make check. Each check plays
+ * games the fast way and the obvious way and counts the ticks on which the
+ * two disagree.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "asciibird.h"
+
+//-------------------------------- Definitions --------------------------------
+
+/** Games played by each check. */
+#define CHECK_GAMES 2000
+
+/** Ticks each game is played for, across as many lives as that takes. */
+#define CHECK_TICKS 6000
+
+//----------------------------- Global Constants ------------------------------
+
+/** On average, the world is resized once in this many ticks. */
+static const int RESIZE_ODDS = 400;
+
+/** Smallest and largest sizes the world is resized to. */
+static const int CHECK_MIN_ROWS = 8, CHECK_MAX_ROWS = 70;
+static const int CHECK_MIN_COLS = 8, CHECK_MAX_COLS = 408;
+
+//--------------------------------- Functions ---------------------------------
+
+/**
+ * Checks whether Flappy crashed by trying every pipe, without the phase
+ * index, as the reference for flappy_crashed().
+ *
+ * @param g
+ *
+ * @return What Flappy crashed into, or ALIVE.
+ */
+death crashed_linear(const game *g) {
+	int h = get_flappy_position(g->f), i;
+
+	if (h <= 0)
+		return DIED_CEILING;
+	if (h >= g->rows - 1)
+		return DIED_FLOOR;
+	for (i = 0; i < g->num_pipes; i++)
+		if (crashed_into_pipe(g->f, g->pipes[i], g->rows))
+			return DIED_PIPE;
+	return ALIVE;
+}
+
+/**
+ * Picks a number in [lo, hi] from a generator.
+ *
+ * @param r
+ * @param lo
+ * @param hi
+ *
+ * @return
+ */
+int check_between(rng *r, int lo, int hi) {
+	return lo + (int) (rng_next(r) % (uint64_t) (hi - lo + 1));
+}
+
+/**
+ * Plays games of random sizes with the autopilot, resizing them at random
+ * moments, and compares flappy_crashed() with crashed_linear() every tick.
+ *
+ * @return Number of ticks on which they disagreed.
+ */
+long check_resizes(void) {
+	long wrong = 0;
+	int i, t, rows, cols;
+	death d;
+	game g;
+	rng r;
+
+	rng_seed(&r, 1);
+	for (i = 0; i < CHECK_GAMES; i++) {
+		rows = check_between(&r, CHECK_MIN_ROWS, CHECK_MAX_ROWS);
+		cols = check_between(&r, CHECK_MIN_COLS, CHECK_MAX_COLS);
+		game_init(&g, i, 1, rows, cols);
+		for (t = 0; t < CHECK_TICKS; t++) {
+			if (check_between(&r, 1, RESIZE_ODDS) == 1) {
+				rows = check_between(&r, CHECK_MIN_ROWS, CHECK_MAX_ROWS);
+				cols = check_between(&r, CHECK_MIN_COLS, CHECK_MAX_COLS);
+				game_resize(&g, rows, cols);
+			}
+			d = physics_tick(&g, autopilot_flap(&g));
+			if (d != crashed_linear(&g)) {
+				if (!wrong)
+					fprintf(stderr, "resizes: seed %d, %dx%d, tick %d: "
+							"%d, linear scan says %d\n", i, g.rows, g.cols,
+							g.ticks, d, crashed_linear(&g));
+				wrong++;
+			}
+			if (d != ALIVE) {
+				end_game(&g);
+				reset_world(&g);
+			}
+		}
+	}
+	return wrong;
+}
+
+int main(void) {
+	long wrong = check_resizes();
+
+	printf("resizes: %ld wrong in %ld ticks\n", wrong,
+			(long) CHECK_GAMES * CHECK_TICKS);
+	return wrong ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file
+ * @author Hamik Mukelyan
+ *
+ * Difficulty presets. One is compiled in, picked with make PRESET=name
+ * (i.e. -DPRESET_name), so its values are constants the compiler folds into
+ * the physics and collision checks. Without one, the game is the normal
+ * game. See README.md for building every preset and choosing one at run
+ * time.
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#if defined(PRESET_easy)
+
+/* A wider opening, at a more forgiving frame rate. */
+#define PRESET_NAME "easy"
+#define CONFIG_GRAV 2
+#define CONFIG_V0 -20
+#define CONFIG_PIPE_RADIUS 3
+#define CONFIG_OPENING_WIDTH 9
+#define CONFIG_FLAPPY_COL 10
+#define CONFIG_TARGET_FPS 20
+
+#elif defined(PRESET_hard)
+
+/* Thicker pipes with a narrower opening, coming faster. */
+#define PRESET_NAME "hard"
+#define CONFIG_GRAV 2
+#define CONFIG_V0 -20
+#define CONFIG_PIPE_RADIUS 4
+#define CONFIG_OPENING_WIDTH 5
+#define CONFIG_FLAPPY_COL 10
+#define CONFIG_TARGET_FPS 30
+
+#elif defined(PRESET_check)
+
+/*
+ * Not one to play: hard's thicker pipes with the original opening, which the
+ * autopilot can get through, for make check.
+ */
+#define PRESET_NAME "check"
+#define CONFIG_GRAV 2
+#define CONFIG_V0 -20
+#define CONFIG_PIPE_RADIUS 4
+#define CONFIG_OPENING_WIDTH 7
+#define CONFIG_FLAPPY_COL 10
+#define CONFIG_TARGET_FPS 24
+
+#else
+
+/* The original game. */
+#define PRESET_NAME "normal"
+#define CONFIG_GRAV 2
+#define CONFIG_V0 -20
+#define CONFIG_PIPE_RADIUS 3
+#define CONFIG_OPENING_WIDTH 7
+#define CONFIG_FLAPPY_COL 10
+#define CONFIG_TARGET_FPS 24
+
+#endif
+
+/** Every preset, for building them all and for choosing one with -d. */
+#define PRESET_NAMES "normal", "easy", "hard"
+
+#endif
@@ -10,484 +10,4137 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <pwd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "asciibird.h"
 
 //-------------------------------- Definitions --------------------------------
 
+/** Most up-arrow presses that can wait for their tick at once. */
+#define INPUT_QUEUE_LEN 16
+
+/** Capacity of the ring from the input thread. Must be a power of two. */
+#define INPUT_RING_LEN 64
+
+/** Size of a cache line, to keep data written by different threads apart. */
+#define CACHE_LINE 64
+
+/** Number of scores a leaderboard file holds. */
+#define LEADERBOARD_LEN 64
+
+/** Number of user names remembered for the failure screen. */
+#define USER_NAMES_CACHED 16
+
+/**
+ * Number of slots in the server's timer wheel. Times WHEEL_SLOT_NS it must
+ * cover a tick period.
+ */
+#define WHEEL_SLOTS 64
+
+/** States of an interactive session, driven by play_interactive(). */
+typedef enum play_state {
+	ST_SPLASH,		// Showing the splash screen.
+	ST_RESTART,		// About to start a game.
+	ST_PLAYING,		// Flappy is in the air.
+	ST_DEAD			// Game over, waiting for a key or a deadline.
+} play_state;
+
+/** What the player asked for with a keystroke. */
+typedef enum input {
+	IN_NONE = 0,
+	IN_FLAP,
+	IN_QUIT,
+
+	/* The terminal changed size. */
+	IN_RESIZE
+} input;
+
+/**
+ * Keystrokes read as soon as they arrive, waiting for the ticks they apply
+ * to.
+ */
+typedef struct input_queue {
+	/* When each pending up-arrow press was read, oldest first, in a ring. */
+	long long flaps[INPUT_QUEUE_LEN];
+	int first, count;
+
+	/* Set when 'q' is pressed or the terminal is resized. */
+	int quit, resized;
+} input_queue;
+
+/**
+ * A table of the best scores, shared by every process that maps the same
+ * leaderboard file. This is the file's layout.
+ */
+typedef struct leaderboard {
+	/* LEADERBOARD_MAGIC. A new file gets it before it's extended. */
+	_Atomic uint64_t magic;
+
+	/*
+	 * The scores, in no particular order. Each entry is a score in the high
+	 * half and the uid of who got it, or LEADERBOARD_GUEST, in the low half,
+	 * so comparing entries compares scores. 0 is an empty entry.
+	 */
+	_Atomic uint64_t entries[LEADERBOARD_LEN];
+} leaderboard;
+
+/** A user's name, as looked up for the failure screen. */
+typedef struct cached_name {
+	uint32_t uid;
+	char name[32];
+} cached_name;
+
+/** A keystroke or resize, as read by the input thread. */
+typedef struct input_event {
+	/* When it was read, as returned by now_ns(). */
+	long long time;
+	input in;
+
+	/* The terminal's new size, for IN_RESIZE. */
+	int rows, cols;
+} input_event;
+
+/**
+ * Lock-free ring of events from exactly one producer thread to exactly one
+ * consumer thread. 'head' and 'tail' count every event ever pushed and
+ * popped; each is written by one side only.
+ */
+typedef struct input_ring {
+	input_event events[INPUT_RING_LEN];
+	_Alignas(CACHE_LINE) _Atomic unsigned head;
+	_Alignas(CACHE_LINE) _Atomic unsigned tail;
+} input_ring;
+
+/** Reads the keyboard on a thread of its own, see key_reader_main(). */
+typedef struct key_reader {
+	input_ring ring;
+	pthread_t thread;
+	_Atomic int stop;
+
+	/*
+	 * A byte goes down this pipe with every event, so the game can sleep
+	 * until one arrives when it has nothing else to do.
+	 */
+	int wake[2];
+
+	/* The terminal's size when the thread was started. */
+	int rows, cols;
+} key_reader;
+
+/**
+ * Kinds of events in a replay file. Each event is stored as a varint
+ * holding (ticks since the previous event << REPLAY_KIND_BITS) | kind.
+ * Version 1 files used a single kind bit and had no resizes.
+ */
+typedef enum replay_event {
+	/* Flappy flapped. */
+	EV_FLAP = 0,
+
+	/* The game ended, by dying or quitting. The next game starts at tick 0. */
+	EV_END = 1,
+
+	/* The world was resized; followed by the new rows and columns. */
+	EV_RESIZE = 2
+} replay_event;
+
+/**
+ * Writes a replay file while a session is played. A replay file starts with
+ * REPLAY_MAGIC, a version byte, a flags byte (bit 0: counter mode), the seed
+ * and the world's rows and columns as varints, followed by the events of each
+ * game in turn.
+ */
+typedef struct recorder {
+	FILE *out;
+
+	/* Tick of the previous event in the current game. */
+	int last_tick;
+} recorder;
+
+/** Reads back a replay file written by a recorder. */
+typedef struct replay {
+	FILE *in;
+
+	/* Seed and rng mode the session was played with. */
+	uint64_t seed;
+	int counter_rng;
+
+	/* Size of the world at the start of the session. */
+	int rows, cols;
+
+	/* Number of low bits of each event that hold its kind. */
+	int kind_bits;
+
+	/* The next event and the tick of the current game it happens at. */
+	replay_event next_kind;
+	int next_tick;
+
+	/* New size of the world, if the next event is a resize. */
+	int next_rows, next_cols;
+
+	/* Nonzero once there are no more events. */
+	int done;
+} replay;
+
+/** A way of playing without a human, selected by name with -m. */
+typedef struct policy {
+	const char *name;
+	policy_fn fn;
+} policy;
+
+/** Outcome of a game played without a human. */
+typedef struct result {
+	/* Final score. */
+	int score;
+
+	/* Number of frames Flappy survived. */
+	int frames;
+
+	/* What killed Flappy, or ALIVE if the game was called off. */
+	death cause;
+} result;
+
+/**
+ * Many independent games laid out as parallel arrays with one entry, or
+ * slot, per game, the same fields as a flappy and two vpipes plus
+ * bookkeeping. Keeping each field contiguous lets batch_step() update every
+ * game with simple loops that the compiler turns into SIMD code. A finished
+ * game's slot can be reused for a new game with batch_start(). Like every
+ * headless game, batched games are NUM_ROWS x NUM_COLS.
+ */
+typedef struct batch {
+	/* Number of slots in the batch. */
+	int n;
+
+	/* A game is finished once it has survived this many frames. */
+	int max_frames;
+
+	/* Flappy's y and v, as in the flappy struct. */
+	int *y, *v;
+
+	/* Center and opening height of each game's two pipes. */
+	int *center[2];
+	float *opening_height[2];
+
+	/* Score of each game and the number of frames it has survived. */
+	int *score, *frames;
+
+	/*
+	 * A death for each game, ALIVE while it's in progress or CALLED_OFF if it
+	 * reached max_frames.
+	 */
+	int *dead;
+
+	/*
+	 * Seed of each game and the number of pipe openings it has drawn. Batches
+	 * always draw openings in counter mode, which needs no other state.
+	 */
+	uint64_t *seed;
+	int *pipes_drawn;
+
+	/* Scratch space for the flap decision of each game. */
+	int *flap;
+
+	/* Scratch space marking the games whose pipe just wrapped. */
+	int *wrapped;
+} batch;
+
+/** Arrays in an environment segment, each with one int32 per slot. */
+typedef enum env_array {
+	/* Written by the trainer: nonzero to flap on the next step. */
+	ENV_FLAP,
+
+	/* Flappy's height and speed, as in the flappy struct, and his row. */
+	ENV_Y, ENV_V, ENV_ROW,
+
+	/* Center of the next pipe and its opening's rows, per get_orow(). */
+	ENV_NEXT_CENTER, ENV_TOP, ENV_BOTTOM,
+
+	/*
+	 * As in a batch: score, frames survived and death, which is ALIVE while
+	 * playing and CALLED_OFF (-1) if the game reached max_frames.
+	 */
+	ENV_SCORE, ENV_FRAMES, ENV_DEAD,
+
+	NUM_ENV_ARRAYS
+} env_array;
+
+/**
+ * Start of a shared-memory segment through which another process steps a
+ * batch of games (see run_env()). The arrays follow, at 'offset' bytes from
+ * the start of the segment. All fields are 32 bits, so the layout is the
+ * same for any trainer that can map the segment.
+ */
+typedef struct env_header {
+	/* ENV_MAGIC, stored last, once everything else is ready. */
+	_Atomic uint64_t magic;
+
+	/* Number of slots, and the world's size and ROW_SCALE, for the trainer. */
+	int32_t n, rows, cols, row_scale;
+
+	/*
+	 * Futex words. The trainer bumps 'request' to ask for a step; once the
+	 * step is done 'done' is set to the same value. Setting 'quit' before
+	 * bumping 'request' shuts the simulator down instead.
+	 */
+	_Atomic uint32_t request, done, quit;
+
+	int32_t offset[NUM_ENV_ARRAYS];
+} env_header;
+
+/** Output for a terminal that's drawn with ANSI escapes, bypassing ncurses. */
+typedef struct ansi_term {
+	/* Output for the current frame. */
+	char *buf;
+	int len, cap;
+
+	/* Where the cursor will be after 'buf', if row isn't -1. */
+	int row, col;
+} ansi_term;
+
+/**
+ * A recording of what's drawn, as an asciicast v2 file. Frames are put
+ * together by the game in one buffer while a writer thread writes out the
+ * other, so the game never waits on the disk.
+ */
+typedef struct capture {
+	FILE *out;
+
+	/* When the recording started, as returned by now_ns(). */
+	long long start;
+
+	/* What the recording shows so far, rows x cols, and the last frame. */
+	char *seen;
+	int rows, cols;
+	ansi_term frame;
+
+	/*
+	 * Events waiting to be written. The game appends to buf[fill]; while
+	 * 'busy', the writer is writing buf[!fill].
+	 */
+	char *buf[2];
+	int len[2], cap[2];
+	int fill, busy, stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} capture;
+
+/** One player connected to the server. */
+typedef struct session {
+	int fd;
+
+	/* The player's game and the session state it's in. */
+	game g;
+	play_state state;
+
+	/* What the player's terminal shows, NUM_ROWS x NUM_COLS, row-major. */
+	char *shown;
+
+	/* When the next tick is due, as returned by now_ns(). */
+	long long next_tick;
+
+	/* Nonzero if the player pressed up since the last tick. */
+	int flap;
+
+	/* Where the input parser is within an escape sequence or Telnet command. */
+	int esc, telnet;
+
+	/* Output the socket hasn't taken yet. No frames are drawn until it has. */
+	char *pending;
+	int pending_len;
+
+	/* Neighbors in the timer wheel slot, if slot isn't -1. */
+	struct session *prev, *next;
+	int slot;
+} session;
+
+/** Serves games to many players from one event loop. */
+typedef struct server {
+	int epfd, listen_fd;
+
+	/*
+	 * Playing sessions, hashed by the WHEEL_SLOT_NS interval their next tick
+	 * falls in. The intervals after 'wheel_time' are yet to be processed;
+	 * the one the clock is in always is, since it may hold later ticks.
+	 */
+	session *wheel[WHEEL_SLOTS];
+	long long wheel_time;
+	int on_wheel;
+
+	/* Session k is seeded with seed + k. */
+	uint64_t seed;
+	int counter_rng;
+	uint64_t sessions_started;
+
+	/* Where a session's output is put together. */
+	ansi_term out;
+} server;
+
+/**
+ * Sends one run of changed cells to a terminal.
+ *
+ * @param ctx Whatever the caller of fb_diff() passed.
+ * @param row
+ * @param col Column of the run's first cell.
+ * @param run The cells' chars; not NUL-terminated.
+ * @param len Number of cells.
+ */
+typedef void (*run_fn)(void *ctx, int row, int col, const char *run, int len);
+
+/**
+ * A micro-benchmark body: performs the operation under test 'iters' times on
+ * the given game.
+ */
+typedef void (*bench_fn)(struct game *g, long iters);
+
+/** A named micro-benchmark. */
+typedef struct benchmark {
+	const char *name;
+	bench_fn fn;
+
+	/* Nonzero if the benchmark writes to the (dummy) terminal. */
+	int to_screen;
+
+	/* Nonzero if it draws with ANSI escapes instead of ncurses. */
+	int ansi;
+} benchmark;
+
+/**
+ * A range [lo, hi) of game numbers packed into one word, so it can be
+ * updated in a single compare-and-swap: lo in the low half, hi in the high.
+ */
+typedef uint64_t game_range;
+
+/** Per-thread state of the work-stealing headless runner. */
+typedef struct worker {
+	/* Games this worker still has to play. Other workers steal from hi. */
+	_Atomic game_range todo;
+
+	/* Index of this worker. */
+	int id;
+
+	/* For picking victims to steal from. */
+	rng rng;
+
+	/* Games played and successful steals, for the report. */
+	int played, steals;
+
+	/* Shared by all workers. */
+	struct pool *pool;
+
+	pthread_t thread;
+} worker;
+
+/** A batch of headless games spread across worker threads. */
+typedef struct pool {
+	worker *workers;
+	int num_workers;
+
+	/* Game number g is seeded with base_seed + g. */
+	uint64_t base_seed;
+
+	/* Whether the games draw pipe openings in counter mode. */
+	int counter_rng;
+
+	/* Give up on a game after this many frames. */
+	int max_frames;
+
+	/* One result per game, each written by whichever worker played it. */
+	result *results;
+} pool;
+
+#ifdef PROFILE
+/** The parts of an interactive frame that are timed separately. */
+typedef enum phase {
+	PH_INPUT = 0,	// Reading keys, but not waiting for them.
+	PH_SIM,			// Physics, recording and replay.
+	PH_DRAW,		// Composing the frame buffer.
+	PH_REFRESH,		// Sending it to the terminal.
+	NUM_PHASES
+} phase;
+
+/** Nanoseconds spent in each phase of one frame. */
+typedef struct frame_times {
+	unsigned int ns[NUM_PHASES];
+} frame_times;
+#endif
+
+//------------------------------ Global Constants -----------------------------
+
+/** Amount of time the splash screen's progress bar takes to fill. */
+const float START_TIME_SEC = 3;
+
+/** The splash screen stays up this long after the progress bar is full. */
+const long long SPLASH_HOLD_NS = 500000000LL;
+
+/** Length of the "progress bar" on the status screen. */
+const int PROG_BAR_LEN = 76;
+
+/** The progress bar shows this many rows above the bottom of the screen. */
+const int PROG_BAR_ROW = 2;
+
+/** Nanoseconds in one second. */
+const long long NSEC_PER_SEC = 1000000000LL;
+
+/**
+ * When the renderer falls behind, at most this many physics ticks are run
+ * back-to-back before a frame is drawn. Past that the schedule is reset
+ * rather than trying to catch up forever.
+ */
+const int MAX_CATCHUP_TICKS = 5;
+
+/**
+ * Changed cells in a row separated by at most this many unchanged cells are
+ * sent to the terminal as a single run.
+ */
+const int MERGE_GAP = 4;
+
+/** Number of games simulated by default in headless mode. */
+const int DEFAULT_HEADLESS_GAMES = 1000;
+
+/**
+ * A headless game is called off after this many frames by default, in case
+ * the autopilot gets good enough to fly forever.
+ */
+const int DEFAULT_MAX_FRAMES = 20000;
+
+/** First bytes of every replay file. */
+const char REPLAY_MAGIC[4] = { 'A', 'B', 'R', 'P' };
+
+/** Version of the replay file format written by this build. */
+const int REPLAY_VERSION = 2;
+
+/** Number of low bits of each replay event that hold its kind. */
+const int REPLAY_KIND_BITS = 2;
+
+/** How long a finished game stays on screen during a replay. */
+const long long REPLAY_PAUSE_NS = 1000000000LL;
+
+/** Each benchmark is timed over batches of iterations lasting at least this. */
+const long long BENCH_MIN_NS = 50000000LL;
+
+/** Number of timed batches per benchmark; the median is reported. */
+const int BENCH_RUNS = 5;
+
+/** In a batch, marks a game that was called off at its frame limit. */
+const int CALLED_OFF = -1;
+
+/**
+ * A batch collects its finished games once at least 1 / BATCH_HARVEST of its
+ * slots are waiting, or all of them are.
+ */
+const int BATCH_HARVEST = 32;
+
+/** Identifies a leaderboard file, and the version of its layout. */
+const uint64_t LEADERBOARD_MAGIC = 0x31424c50414c46ULL; // "FLAPLB1"
+
+/** How many of the best scores the failure screen shows. */
+const int HIGH_SCORES_SHOWN = 3;
+
+/**
+ * Owner of the scores posted by the server's anonymous players, shown as
+ * "guest". No user has it, since (uid_t) -1 is never a valid uid.
+ */
+const uint32_t LEADERBOARD_GUEST = UINT32_MAX;
+
+/** First bytes of every environment segment, "FLAPENV1". */
+const uint64_t ENV_MAGIC = 0x31564e4550414c46ULL;
+
+/**
+ * How often the input thread checks for a terminal resize it wasn't
+ * interrupted for, and for being told to stop, in milliseconds.
+ */
+const int KEY_POLL_MS = 100;
+
+/**
+ * Bytes per row, on top of two per cell, that a frame drawn with ANSI escapes
+ * can take for moving the cursor to that row.
+ */
+const int ANSI_ROW_SLACK = 16;
+
+/**
+ * Cells a row must save before it's worth shifting it with a delete-char
+ * instead of redrawing them.
+ */
+const int ANSI_SHIFT_COST = 2;
+
+/** Width of the server's timer wheel slots. */
+const long long WHEEL_SLOT_NS = 1000000LL;
+
+/** Length of the server's queue of connections waiting to be accepted. */
+const int SERVER_BACKLOG = 128;
+
+/**
+ * Bytes of captured frames handed to the writer thread at a time. Waking the
+ * writer costs a context switch, so it's done every few dozen frames rather
+ * than every frame.
+ */
+const int CAPTURE_BATCH = 1 << 14;
+
+/** Telnet bytes: "interpret as command" and the commands the server uses. */
+const unsigned char TELNET_IAC = 255, TELNET_WILL = 251, TELNET_SB = 250,
+		TELNET_SE = 240, TELNET_ECHO = 1, TELNET_SGA = 3;
+
+/**
+ * Sent to every new player: Telnet "I'll echo" and "I'll suppress go-ahead",
+ * which put Telnet clients in character mode without local echo, then clear
+ * the screen and hide the cursor. Raw TCP clients just see the escapes.
+ */
+const char SESSION_HELLO[] = "\377\373\001\377\373\003\033[2J\033[?25l";
+
+/** Sent to a player on the way out: show the cursor and clear the screen. */
+const char SESSION_BYE[] = "\033[?25h\033[2J\033[H";
+
+/** Printable names of the ways a game can end, indexed by death. */
+const char *DEATH_NAMES[] = { "alive", "ceiling", "floor", "pipe" };
+
+#ifdef PROFILE
+/** Frame timings are kept for this many of the most recent frames. */
+const long PROFILE_MAX_FRAMES = 1 << 16;
+
+/** Printable names of the profiled phases, indexed by phase. */
+const char *PHASE_NAMES[] = { "input", "sim", "draw", "refresh" };
+#endif
+
+//------------------------------ Global Variables -----------------------------
+
+/**
+ * Off-screen frame buffer that frames are drawn into, the size of the
+ * terminal. See fb_init().
+ */
+canvas fb;
+
+/**
+ * Char the terminal is currently showing at each cell, row-major, as far as
+ * the renderer knows. Only cells where this differs from 'fb' are sent.
+ */
+char *shown = NULL;
+
+/**
+ * If not -1, the terminal is drawn by writing ANSI escapes to this file
+ * descriptor, through 'tty', instead of through ncurses. ncurses still reads
+ * the keyboard.
+ */
+int ansi_fd = -1;
+ansi_term tty;
+
+/**
+ * If nonzero, the keyboard is read by the input thread in 'keys' instead of
+ * with getch(), and the game only ever takes its events from a lock-free
+ * ring.
+ */
+int keys_threaded = 0;
+key_reader keys;
+
+/**
+ * If not NULL, this plays interactive games instead of the player, and
+ * headless games instead of autopilot_flap().
+ */
+policy_fn bot = NULL;
+
+/** If not NULL, every frame that's flushed is captured here. */
+capture *cast = NULL;
+
+/** If not NULL, every game's score is posted to this leaderboard. */
+leaderboard *scores = NULL;
+
+/** The top of the leaderboard, as shown on the failure screen. */
+char high_scores[80] = "";
+
+/**
+ * Names of the users seen on the leaderboard, so that each is looked up only
+ * once: a lookup can block on a network directory, which the server's event
+ * loop mustn't do over and over. Entry n is filled n-th and, once they're all
+ * taken, replaced by the (n + USER_NAMES_CACHED)-th.
+ */
+cached_name user_names[USER_NAMES_CACHED];
+int user_names_seen = 0;
+
+#ifdef PROFILE
+/** Ring of the timings of the last PROFILE_MAX_FRAMES frames. */
+frame_times *prof_frames = NULL;
+
+/**
+ * Frames timed so far. Frame n's timings are in slot n % PROFILE_MAX_FRAMES.
+ */
+long prof_count = 0;
+
+/** Timings of the frame in progress. */
+frame_times prof_cur;
+
+/** Clock reading at the end of the last timed phase. */
+long long prof_last = 0;
+
+/** Whether the last frame's timings are shown next to the score. */
+int prof_overlay = 0;
+
+/** If not NULL, frame-time percentiles and a histogram are written here. */
+const char *prof_path = NULL;
+#endif
+
+//---------------------------------- Functions --------------------------------
+
+/**
+ * Reads the monotonic clock, which unlike the wall clock never jumps.
+ *
+ * @return Nanoseconds since some fixed, unspecified point.
+ */
+long long now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * Sleeps until the monotonic clock reaches the given absolute deadline.
+ * Sleeping to an absolute time instead of for a duration means time spent
+ * rendering is automatically made up for and errors don't accumulate.
+ *
+ * @param deadline Wake-up time, as returned by now_ns().
+ */
+void sleep_until(long long deadline) {
+	struct timespec ts;
+	ts.tv_sec = deadline / NSEC_PER_SEC;
+	ts.tv_nsec = deadline % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/**
+ * Makes room for at least 'len' more bytes in an ANSI terminal's output.
+ * The buffer is sized for a whole frame by ansi_init(), so this only grows
+ * it if a frame somehow needs more.
+ *
+ * @param t
+ * @param len
+ */
+void ansi_reserve(ansi_term *t, int len) {
+	if (t->len + len <= t->cap)
+		return;
+	t->cap = 2 * (t->len + len);
+	t->buf = realloc(t->buf, t->cap);
+	assert(t->buf);
+}
+
+/**
+ * Sizes an ANSI terminal's output buffer for the worst-case frame of the
+ * given size and forgets where the cursor is.
+ *
+ * @param t
+ * @param rows
+ * @param cols
+ */
+void ansi_init(ansi_term *t, int rows, int cols) {
+	ansi_reserve(t, 2 * rows * cols + ANSI_ROW_SLACK * rows);
+	t->row = -1;
+}
+
+/**
+ * Appends bytes to an ANSI terminal's output.
+ *
+ * @param t
+ * @param bytes
+ * @param len
+ */
+void ansi_bytes(ansi_term *t, const char *bytes, int len) {
+	ansi_reserve(t, len);
+	memcpy(t->buf + t->len, bytes, len);
+	t->len += len;
+}
+
+/**
+ * Writes a number in decimal.
+ *
+ * @param out Room for at least 11 bytes.
+ * @param n Not negative.
+ *
+ * @return Number of bytes written.
+ */
+int ansi_dec(char *out, int n) {
+	char digits[12];
+	int len = 0, i = 0;
+
+	do
+		digits[i++] = '0' + n % 10;
+	while (n /= 10);
+	while (i)
+		out[len++] = digits[--i];
+	return len;
+}
+
+/**
+ * Writes an escape sequence with one decimal parameter, ESC [ n final.
+ *
+ * @param out Room for at least 14 bytes.
+ * @param n Not negative.
+ * @param final
+ *
+ * @return Number of bytes written.
+ */
+int ansi_csi(char *out, int n, char final) {
+	int len;
+
+	out[0] = '\033';
+	out[1] = '[';
+	len = 2 + ansi_dec(out + 2, n);
+	out[len++] = final;
+	return len;
+}
+
+/**
+ * Appends the shortest cursor movement to a cell: relative to where the
+ * cursor is, if that's known and shorter, else absolute.
+ *
+ * @param t
+ * @param row
+ * @param col
+ */
+void ansi_move(ansi_term *t, int row, int col) {
+	char rel[32], abs[32];
+	int rel_len = 0, abs_len;
+
+	// ESC [ row ; col H, both 1-based.
+	abs_len = ansi_csi(abs, row + 1, ';');
+	abs_len += ansi_dec(abs + abs_len, col + 1);
+	abs[abs_len++] = 'H';
+
+	if (t->row < 0 || row < t->row)
+		rel_len = INT_MAX;
+	else if (row == t->row + 1 && col == 0) {
+		rel[rel_len++] = '\r';
+		rel[rel_len++] = '\n';
+	}
+	else {
+		if (row > t->row)
+			rel_len += ansi_csi(rel + rel_len, row - t->row, 'B');
+		if (col == 0 && t->col > 0)
+			rel[rel_len++] = '\r';
+		else if (col > t->col)
+			rel_len += ansi_csi(rel + rel_len, col - t->col, 'C');
+		else if (col < t->col)
+			rel_len += ansi_csi(rel + rel_len, t->col - col, 'D');
+	}
+
+	if (rel_len <= abs_len)
+		ansi_bytes(t, rel, rel_len);
+	else
+		ansi_bytes(t, abs, abs_len);
+	t->row = row;
+	t->col = col;
+}
+
+/**
+ * A run_fn that appends the cursor movement to the run and its chars to the
+ * ansi_term in 'ctx'.
+ */
+void ansi_run(void *ctx, int row, int col, const char *run, int len) {
+	ansi_term *t = ctx;
+
+	ansi_move(t, row, col);
+	ansi_bytes(t, run, len);
+
+	// Past the last column the cursor waits to wrap, at a spot that
+	// terminals disagree on.
+	t->row = col + len < fb.cols ? row : -1;
+	t->col = col + len;
+}
+
+/**
+ * Writes out and empties an ANSI terminal's output, in one write() unless
+ * the terminal takes less.
+ *
+ * @param t
+ * @param fd
+ */
+void ansi_write(ansi_term *t, int fd) {
+	ssize_t n;
+	int done = 0;
+
+	while (done < t->len) {
+		if ((n = write(fd, t->buf + done, t->len - done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			t->row = -1; // Lost track of the terminal.
+			break;
+		}
+		done += n;
+	}
+	t->len = 0;
+}
+
+/**
+ * Forgets what the terminal shows. Call after the screen has been cleared
+ * behind the renderer's back, e.g. by the splash or failure screens.
+ */
+void fb_reset() {
+	memset(shown, ' ', fb.rows * fb.cols);
+}
+
+/**
+ * (Re)allocates the frame buffer for a terminal of the given size. Must be
+ * called before anything is drawn, and again whenever the terminal is
+ * resized, after which the whole screen is redrawn on the next flush.
+ *
+ * @param rows
+ * @param cols
+ */
+void fb_init(int rows, int cols) {
+	canvas_init(&fb, realloc(fb.cells, rows * cols), rows, cols);
+	shown = realloc(shown, rows * cols);
+	assert(fb.cells && shown);
+	memset(fb.cells, ' ', rows * cols);
+	fb_reset();
+	if (ansi_fd >= 0)
+		ansi_init(&tty, rows, cols);
+}
+
+/**
+ * Compares a row of the frame buffer against what a terminal already shows
+ * there and hands its runs of changed cells to 'emit', like fb_diff().
+ *
+ * @param r
+ * @param have What row 'r' of the terminal shows. Updated to match.
+ * @param emit
+ * @param ctx
+ */
+void fb_diff_row(int r, char *have, run_fn emit, void *ctx) {
+	const char *want = fb.cells + r * fb.cols;
+	int c, start, end;
+
+	if (!memcmp(want, have, fb.cols))
+		return;
+
+	for (c = 0; c < fb.cols; ) {
+		if (want[c] == have[c]) {
+			c++;
+			continue;
+		}
+
+		// Extend the run until MERGE_GAP unchanged cells in a row.
+		start = end = c;
+		for (; c < fb.cols && c - end <= MERGE_GAP; c++)
+			if (want[c] != have[c])
+				end = c + 1;
+
+		emit(ctx, r, start, want + start, end - start);
+		c = end;
+	}
+	memcpy(have, want, fb.cols);
+}
+
+/**
+ * Compares the frame buffer against what a terminal already shows and hands
+ * every run of changed cells to 'emit'. Runs separated by only a few
+ * unchanged cells are merged, since repainting those is cheaper than moving
+ * the cursor past them. Afterwards 'seen' matches the frame buffer.
+ *
+ * @param seen What the terminal shows, fb.rows x fb.cols, row-major.
+ * @param emit Called for each run, in order.
+ * @param ctx Passed through to 'emit'.
+ */
+void fb_diff(char *seen, run_fn emit, void *ctx) {
+	int r;
+
+	for (r = 0; r < fb.rows; r++)
+		fb_diff_row(r, seen + r * fb.cols, emit, ctx);
+}
+
+/** A run_fn that draws with ncurses. */
+void curses_run(void *ctx, int row, int col, const char *run, int len) {
+	mvaddnstr(row, col, run, len);
+}
+
+/**
+ * Appends the escapes that bring an ANSI terminal from showing 'seen' to
+ * showing the frame buffer, like fb_diff(). A row whose contents mostly
+ * moved one cell left, like the scrolling floor and ceiling, is first
+ * shifted with a delete-char, so only the cells that didn't move are
+ * redrawn.
+ *
+ * @param t
+ * @param seen What the terminal shows. Updated to match the frame buffer.
+ */
+void ansi_diff(ansi_term *t, char *seen) {
+	const char *want;
+	char *have;
+	int r, c, stay, shift;
+
+	for (r = 0; r < fb.rows; r++) {
+		want = fb.cells + r * fb.cols;
+		have = seen + r * fb.cols;
+		if (!memcmp(want, have, fb.cols))
+			continue;
+
+		// Count the cells that would need drawing either way.
+		stay = want[fb.cols - 1] != have[fb.cols - 1];
+		shift = want[fb.cols - 1] != ' ';
+		for (c = 0; c < fb.cols - 1; c++) {
+			stay += want[c] != have[c];
+			shift += want[c] != have[c + 1];
+		}
+
+		if (shift + ANSI_SHIFT_COST < stay) {
+			ansi_move(t, r, 0);
+			ansi_bytes(t, "\033[P", 3);
+			memmove(have, have + 1, fb.cols - 1);
+			have[fb.cols - 1] = ' ';
+		}
+		fb_diff_row(r, have, ansi_run, t);
+	}
+}
+
+/**
+ * Body of a capture's writer thread: writes out each buffer the game hands
+ * over, until told to stop.
+ *
+ * @param arg The capture.
+ *
+ * @return NULL.
+ */
+void *capture_writer(void *arg) {
+	capture *c = arg;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		while (!c->busy && !c->stop)
+			pthread_cond_wait(&c->cond, &c->lock);
+		if (!c->busy)
+			break;
+		i = !c->fill;
+		pthread_mutex_unlock(&c->lock);
+
+		fwrite(c->buf[i], 1, c->len[i], c->out);
+		fflush(c->out);
+
+		pthread_mutex_lock(&c->lock);
+		c->len[i] = 0;
+		c->busy = 0;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+/**
+ * Makes room for at least 'len' more bytes in the buffer the game is
+ * filling.
+ *
+ * @param c
+ * @param len
+ *
+ * @return Where the bytes go.
+ */
+char *capture_reserve(capture *c, int len) {
+	int i = c->fill;
+
+	if (c->len[i] + len > c->cap[i]) {
+		c->cap[i] = 2 * (c->len[i] + len);
+		c->buf[i] = realloc(c->buf[i], c->cap[i]);
+		assert(c->buf[i]);
+	}
+	return c->buf[i] + c->len[i];
+}
+
+/**
+ * Appends bytes to the buffer the game is filling.
+ *
+ * @param c
+ * @param bytes
+ * @param len
+ */
+void capture_bytes(capture *c, const char *bytes, int len) {
+	memcpy(capture_reserve(c, len), bytes, len);
+	c->len[c->fill] += len;
+}
+
+/**
+ * Appends an asciicast event: [time, "kind", "data"] on a line of its own,
+ * with the data escaped as a JSON string.
+ *
+ * @param c
+ * @param secs Time since the start of the recording.
+ * @param kind "o" for output, "r" for a resize.
+ * @param data
+ * @param len
+ */
+void capture_event(capture *c, double secs, const char *kind,
+		const char *data, int len) {
+	char head[64];
+	unsigned char ch;
+	char *out, *start;
+	int i;
+
+	capture_bytes(c, head, snprintf(head, sizeof(head), "[%.6f, \"%s\", \"",
+			secs, kind));
+
+	// At worst every byte is a control character, written as \u00XX.
+	out = start = capture_reserve(c, 6 * len + 3);
+	for (i = 0; i < len; i++) {
+		ch = data[i];
+		if (ch < ' ') {
+			memcpy(out, "\\u00", 4);
+			out[4] = "0123456789abcdef"[ch >> 4];
+			out[5] = "0123456789abcdef"[ch & 15];
+			out += 6;
+			continue;
+		}
+		if (ch == '"' || ch == '\\')
+			*out++ = '\\';
+		*out++ = ch;
+	}
+	memcpy(out, "\"]\n", 3);
+	c->len[c->fill] += out + 3 - start;
+}
+
+/**
+ * Hands the buffer the game has been filling to the writer thread once it
+ * holds CAPTURE_BATCH bytes, unless the writer is still busy with the other
+ * one, in which case the game just keeps filling this one. Never waits for
+ * the writer.
+ *
+ * @param c
+ */
+void capture_kick(capture *c) {
+	if (c->len[c->fill] < CAPTURE_BATCH)
+		return;
+	pthread_mutex_lock(&c->lock);
+	if (!c->busy) {
+		c->fill = !c->fill;
+		c->busy = 1;
+		pthread_cond_signal(&c->cond);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Starts capturing what's drawn to an asciicast v2 file, which asciinema
+ * can play back and tools such as agg turn into a GIF.
+ *
+ * @param path
+ * @param rows Size of the screen being captured.
+ * @param cols
+ *
+ * @return The capture, or NULL with errno set if the file can't be created.
+ */
+capture *capture_open(const char *path, int rows, int cols) {
+	char header[128];
+	capture *c = calloc(1, sizeof(capture));
+
+	assert(c);
+	if (!(c->out = fopen(path, "w"))) {
+		free(c);
+		return NULL;
+	}
+	c->start = now_ns();
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+
+	// The recording starts from a blank screen with the cursor hidden.
+	capture_bytes(c, header, snprintf(header, sizeof(header),
+			"{\"version\": 2, \"width\": %d, \"height\": %d, "
+			"\"timestamp\": %lld}\n", cols, rows, (long long) time(NULL)));
+	capture_event(c, 0, "o", "\033[?25l\033[2J", 10);
+	c->rows = rows;
+	c->cols = cols;
+	c->seen = malloc(rows * cols);
+	assert(c->seen);
+	memset(c->seen, ' ', rows * cols);
+	ansi_init(&c->frame, rows, cols);
+
+	if (pthread_create(&c->thread, NULL, capture_writer, c)) {
+		fclose(c->out);
+		free(c->seen);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/**
+ * Captures the frame buffer as a frame of the recording: the escapes that
+ * turn the previous frame into this one, worked out the same way as for an
+ * ANSI terminal. A change in the frame buffer's size is recorded as a
+ * resize followed by a full redraw.
+ *
+ * @param c
+ * @param ns Time of the frame since the start of the recording.
+ */
+void capture_frame(capture *c, long long ns) {
+	char size[32];
+	double secs = ns / (double) NSEC_PER_SEC;
+
+	if (c->rows != fb.rows || c->cols != fb.cols) {
+		c->rows = fb.rows;
+		c->cols = fb.cols;
+		c->seen = realloc(c->seen, fb.rows * fb.cols);
+		assert(c->seen);
+		memset(c->seen, ' ', fb.rows * fb.cols);
+		capture_event(c, secs, "r", size, snprintf(size, sizeof(size),
+				"%dx%d", fb.cols, fb.rows));
+		ansi_bytes(&c->frame, "\033[2J", 4);
+		c->frame.row = -1;
+	}
+
+	ansi_diff(&c->frame, c->seen);
+	if (c->frame.len)
+		capture_event(c, secs, "o", c->frame.buf, c->frame.len);
+	c->frame.len = 0;
+	capture_kick(c);
+}
+
+/**
+ * Stops capturing: hands the writer thread what's left, waits for it to
+ * finish and closes the file.
+ *
+ * @param c
+ */
+void capture_close(capture *c) {
+	pthread_mutex_lock(&c->lock);
+	while (c->busy)
+		pthread_cond_wait(&c->cond, &c->lock);
+	if (c->len[c->fill]) {
+		c->fill = !c->fill;
+		c->busy = 1;
+	}
+	c->stop = 1;
+	pthread_cond_broadcast(&c->cond);
+	pthread_mutex_unlock(&c->lock);
+	pthread_join(c->thread, NULL);
+
+	fclose(c->out);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	free(c->buf[0]);
+	free(c->buf[1]);
+	free(c->frame.buf);
+	free(c->seen);
+	free(c);
+}
+
+/**
+ * Sends the frame buffer to the terminal, only the cells that changed since
+ * the last flush. With ncurses they show up on the next refresh(); with ANSI
+ * escapes (see ansi_fd) they're written right away, in one write(). If
+ * capturing, the frame is captured too.
+ */
+void fb_flush() {
+	if (ansi_fd >= 0) {
+		ansi_diff(&tty, shown);
+		ansi_write(&tty, ansi_fd);
+	}
+	else
+		fb_diff(shown, curses_run, NULL);
+	if (cast)
+		capture_frame(cast, now_ns() - cast->start);
+}
+
+/**
+ * Blanks the terminal, so that the next flush redraws every cell.
+ */
+void screen_clear() {
+	clear();
+
+	// Let ncurses do its clearing now, so it doesn't do it over a later
+	// frame, and send the cursor home.
+	if (ansi_fd >= 0) {
+		refresh();
+		tty.row = -1;
+	}
+	fb_reset();
+}
+
+/**
+ * Maps a leaderboard file into memory, creating it if needed. Any number of
+ * processes can have the same file mapped and post to it at once. Only an
+ * empty file is made into a leaderboard; any other file is left alone
+ * unless it's a leaderboard already.
+ *
+ * @param path
+ *
+ * @return The leaderboard, or NULL with errno set if the file can't be
+ * opened or isn't a leaderboard.
+ */
+leaderboard *leaderboard_open(const char *path) {
+	struct stat st;
+	leaderboard *lb;
+	uint64_t magic = LEADERBOARD_MAGIC;
+	int fd = open(path, O_RDWR | O_CREAT, 0666);
+
+	if (fd < 0)
+		return NULL;
+
+	// An empty file gets the magic number first and is then extended with
+	// zeros, which are an empty table, so a full-size file always has it.
+	// Racing creators write the same bytes. A file that's short but starts
+	// with the magic number is one that's being created right now.
+	if (fstat(fd, &st) || (st.st_size == 0 &&
+			pwrite(fd, &magic, sizeof(magic), 0) != sizeof(magic))) {
+		close(fd);
+		return NULL;
+	}
+	if (pread(fd, &magic, sizeof(magic), 0) != sizeof(magic) ||
+			magic != LEADERBOARD_MAGIC ||
+			st.st_size > (off_t) sizeof(leaderboard)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	if (st.st_size < (off_t) sizeof(leaderboard) &&
+			ftruncate(fd, sizeof(leaderboard))) {
+		close(fd);
+		return NULL;
+	}
+	lb = mmap(NULL, sizeof(leaderboard), PROT_READ | PROT_WRITE, MAP_SHARED,
+			fd, 0);
+	close(fd);
+	return lb == MAP_FAILED ? NULL : lb;
+}
+
+/**
+ * Posts a score to a leaderboard. A score only gets in by beating the
+ * lowest one there, which it replaces with a single compare-and-swap; if
+ * another process changed that entry first, the lowest is looked for again.
+ * Entries only ever grow, so this always ends.
+ *
+ * @param lb
+ * @param score
+ * @param owner Uid of who got the score, or LEADERBOARD_GUEST.
+ */
+void leaderboard_post(leaderboard *lb, int score, uint32_t owner) {
+	uint64_t entry = (uint64_t) score << 32 | owner, low = 0, e;
+	int i, lowest = 0;
+
+	if (score <= 0)
+		return;
+	do {
+		for (i = 0; i < LEADERBOARD_LEN; i++) {
+			e = atomic_load(&lb->entries[i]);
+			if (!i || e < low) {
+				low = e;
+				lowest = i;
+			}
+		}
+		if (entry <= low)
+			return;
+	} while (!atomic_compare_exchange_weak(&lb->entries[lowest], &low,
+			entry));
+}
+
+/**
+ * Gets the current user's best score on a leaderboard.
+ *
+ * @param lb
+ *
+ * @return The best score, or 0 if the user isn't on it.
+ */
+int leaderboard_best(leaderboard *lb) {
+	uint64_t entry;
+	int i, best = 0;
+
+	for (i = 0; i < LEADERBOARD_LEN; i++) {
+		entry = atomic_load(&lb->entries[i]);
+		if ((uint32_t) entry == (uint32_t) getuid() && entry >> 32 > best)
+			best = entry >> 32;
+	}
+	return best;
+}
+
+int compare_entries(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x < y) - (x > y); // Highest first.
+}
+
+/**
+ * Looks up the name of the owner of a leaderboard entry, through
+ * 'user_names'.
+ *
+ * @param uid A uid or LEADERBOARD_GUEST.
+ *
+ * @return The name, "guest" or "?" if the uid has none.
+ */
+const char *user_name(uint32_t uid) {
+	struct passwd *pw;
+	int i, n = user_names_seen < USER_NAMES_CACHED ? user_names_seen :
+			USER_NAMES_CACHED;
+
+	if (uid == LEADERBOARD_GUEST)
+		return "guest";
+	for (i = 0; i < n; i++)
+		if (user_names[i].uid == uid)
+			return user_names[i].name;
+	i = user_names_seen++ % USER_NAMES_CACHED;
+	pw = getpwuid(uid);
+	user_names[i].uid = uid;
+	snprintf(user_names[i].name, sizeof(user_names[i].name), "%s",
+			pw ? pw->pw_name : "?");
+	return user_names[i].name;
+}
+
+/**
+ * Formats the top of a leaderboard into 'high_scores', for the failure
+ * screen, e.g. "High scores: 31 ann, 17 guest, 12 ann".
+ *
+ * @param lb
+ */
+void leaderboard_format(leaderboard *lb) {
+	uint64_t top[LEADERBOARD_LEN];
+	int i, len;
+
+	for (i = 0; i < LEADERBOARD_LEN; i++)
+		top[i] = atomic_load(&lb->entries[i]);
+	qsort(top, LEADERBOARD_LEN, sizeof(uint64_t), compare_entries);
+
+	len = snprintf(high_scores, sizeof(high_scores), "High scores:");
+	for (i = 0; i < HIGH_SCORES_SHOWN && top[i] >> 32; i++) {
+		len += snprintf(high_scores + len, sizeof(high_scores) - len,
+				"%s %u %s", i ? "," : "", (unsigned) (top[i] >> 32),
+				user_name((uint32_t) top[i]));
+		if (len >= sizeof(high_scores))
+			break;
+	}
+	if (!i)
+		high_scores[0] = '\0';
+}
+
+/**
+ * Posts the score of the game that just ended to the leaderboard, if there
+ * is one, and updates the high scores shown on the failure screen.
+ *
+ * @param g
+ * @param owner As for leaderboard_post().
+ */
+void post_score(const game *g, uint32_t owner) {
+	if (!scores)
+		return;
+	leaderboard_post(scores, g->score, owner);
+	leaderboard_format(scores);
+}
+
+/**
+ * Composes a failure screen asking the user to either play again or quit in
+ * the frame buffer, with the high scores under it if there's a leaderboard.
+ * Only draws; the answer is read by the caller.
+ */
+void compose_failure() {
+	canvas_clear(&fb);
+	put_str(&fb, fb.rows / 2 - 1, fb.cols / 2 - 22,
+			"Flappy died :-(. <Enter> to flap, 'q' to quit.");
+	put_str(&fb, fb.rows / 2 + 1, fb.cols / 2 - (int) strlen(high_scores) / 2,
+			high_scores);
+}
+
+/** Shows the failure screen on the terminal. */
+void failure_screen() {
+	compose_failure();
+	fb_flush();
+	refresh();
+}
+
+/**
+ * Draws the splash screen with a partly filled progress bar. NB the ASCII
+ * art was generated by patorjk.com.
+ *
+ * @param filled Number of cells of the progress bar to fill.
+ */
+void splash_screen(int filled) {
+	int i;
+	int r = fb.rows / 2 - 6;
+	int c = fb.cols / 2 - 22;
+	int bar_row = fb.rows - PROG_BAR_ROW;
+	int bar_col = fb.cols / 2 - PROG_BAR_LEN / 2;
+
+	// Print the title.
+	canvas_clear(&fb);
+	put_str(&fb, r, c,     " ___ _                       ___ _        _ ");
+	put_str(&fb, r + 1, c, "| __| |__ _ _ __ _ __ _  _  | _ |_)_ _ __| |");
+	put_str(&fb, r + 2, c, "| _|| / _` | '_ \\ '_ \\ || | | _ \\ | '_/ _` |");
+	put_str(&fb, r + 3, c, "|_| |_\\__,_| .__/ .__/\\_, | |___/_|_| \\__,_|");
+	put_str(&fb, r + 4, c, "           |_|  |_|   |__/                  ");
+	put_str(&fb, fb.rows / 2 + 1, fb.cols / 2 - 10, "Press <up> to flap!");
+
+	// Print the progress bar.
+	put_ch(&fb, bar_row, bar_col - 1, '[');
+	put_ch(&fb, bar_row, fb.cols / 2 + PROG_BAR_LEN / 2, ']');
+	for (i = 0; i < filled && i < PROG_BAR_LEN; i++)
+		put_ch(&fb, bar_row, bar_col + i, '=');
+	fb_flush();
+	refresh();
+}
+
+#ifdef PROFILE
+/**
+ * Allocates the ring of frame timings.
+ */
+void profile_init() {
+	prof_frames = malloc(PROFILE_MAX_FRAMES * sizeof(frame_times));
+	assert(prof_frames);
+}
+
+/**
+ * Starts timing a frame: all phases at zero, the clock running from now.
+ */
+void profile_start() {
+	memset(&prof_cur, 0, sizeof(prof_cur));
+	prof_last = now_ns();
+}
+
+/**
+ * Restarts the clock without charging the time since the last mark to any
+ * phase, so sleeping until the next tick doesn't count.
+ */
+void profile_skip() {
+	prof_last = now_ns();
+}
+
+/**
+ * Charges the time since the last mark to the given phase of the current
+ * frame. A phase can be charged several times in one frame.
+ *
+ * @param ph
+ */
+void profile_mark(phase ph) {
+	long long t = now_ns();
+	prof_cur.ns[ph] += t - prof_last;
+	prof_last = t;
+}
+
+/**
+ * Files the current frame's timings in the ring.
+ */
+void profile_end() {
+	prof_frames[prof_count++ % PROFILE_MAX_FRAMES] = prof_cur;
+}
+
+/**
+ * Draws the last frame's timings, in microseconds, just left of the score.
+ *
+ * @param g
+ */
+void profile_overlay(const game *g) {
+	char buf[64];
+	const frame_times *ft;
+	int len;
+
+	if (!prof_overlay || prof_count == 0)
+		return;
+	ft = &prof_frames[(prof_count - 1) % PROFILE_MAX_FRAMES];
+	len = snprintf(buf, sizeof(buf), " in %u sim %u draw %u ref %u us",
+			ft->ns[PH_INPUT] / 1000, ft->ns[PH_SIM] / 1000,
+			ft->ns[PH_DRAW] / 1000, ft->ns[PH_REFRESH] / 1000);
+	put_str(&fb, 0, hud_col(g) - len, buf);
+}
+
+int compare_uint(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Writes the p50, p99 and max time of each phase and of whole frames over
+ * the timed frames still in the ring, then a histogram of whole-frame times
+ * in power-of-two microsecond buckets, to prof_path.
+ */
+void profile_dump() {
+	long n = prof_count < PROFILE_MAX_FRAMES ? prof_count : PROFILE_MAX_FRAMES;
+	unsigned int *v, total;
+	long hist[32] = { 0 };
+	FILE *out;
+	long i;
+	int ph, b;
+
+	if (!prof_path || n == 0)
+		return;
+	if (!(out = fopen(prof_path, "w"))) {
+		fprintf(stderr, "%s: %s\n", prof_path, strerror(errno));
+		return;
+	}
+	v = malloc(n * sizeof(*v));
+	assert(v);
+
+	fprintf(out, "# %ld frames\nphase\tp50_us\tp99_us\tmax_us\n", n);
+	for (ph = 0; ph <= NUM_PHASES; ph++) {
+		for (i = 0; i < n; i++) {
+			if (ph < NUM_PHASES)
+				v[i] = prof_frames[i].ns[ph];
+			else
+				for (v[i] = 0, b = 0; b < NUM_PHASES; b++)
+					v[i] += prof_frames[i].ns[b];
+		}
+		qsort(v, n, sizeof(*v), compare_uint);
+		fprintf(out, "%s\t%.1f\t%.1f\t%.1f\n",
+				ph < NUM_PHASES ? PHASE_NAMES[ph] : "frame", v[n / 2] / 1e3,
+				v[n * 99 / 100] / 1e3, v[n - 1] / 1e3);
+	}
+
+	// v still holds the whole-frame times.
+	for (i = 0; i < n; i++) {
+		for (total = v[i] / 1000, b = 0; total > 1; total >>= 1)
+			b++;
+		hist[b]++;
+	}
+	fprintf(out, "\nframe_us\tframes\n");
+	for (b = 0; b < 32; b++)
+		if (hist[b])
+			fprintf(out, "<%u\t%ld\n", 2u << b, hist[b]);
+
+	free(v);
+	fclose(out);
+}
+
+#define PROFILE_START() profile_start()
+#define PROFILE_MARK(ph) profile_mark(ph)
+#define PROFILE_SKIP() profile_skip()
+#define PROFILE_END() profile_end()
+#define PROFILE_OVERLAY(g) profile_overlay(g)
+#define PROFILE_OPTS "P:O"
+#else
+// Profiling is compiled out: the hooks vanish.
+#define PROFILE_START() ((void) 0)
+#define PROFILE_MARK(ph) ((void) 0)
+#define PROFILE_SKIP() ((void) 0)
+#define PROFILE_END() ((void) 0)
+#define PROFILE_OVERLAY(g) ((void) 0)
+#define PROFILE_OPTS ""
+#endif
+
+/**
+ * Makes sense of a keystroke.
+ *
+ * @param ch As returned by getch().
+ *
+ * @return What the user asked for.
+ */
+input read_input(int ch) {
+	switch (ch) {
+	case 'q': // Quit.
+		return IN_QUIT;
+	case KEY_UP:
+		return IN_FLAP;
+	case KEY_RESIZE:
+		return IN_RESIZE;
+	}
+	return IN_NONE;
+}
+
+/**
+ * Makes sense of raw terminal input a byte at a time, for when it doesn't go
+ * through ncurses. An up arrow is ESC [ A or, in keypad mode, ESC O A. An
+ * ESC followed by anything else, such as Alt+q sent as ESC q, is just Esc and
+ * then that key.
+ *
+ * @param esc How far into an escape sequence the input is; 0 to begin with.
+ * @param c
+ *
+ * @return What the key asks for (IN_NONE for any other key), or -1 in the
+ * middle of an escape sequence.
+ */
+int parse_key(int *esc, unsigned char c) {
+	// ANSI: ESC, then '[' or 'O', then parameters up to a final byte.
+	if (*esc == 1) {
+		*esc = c == '[' || c == 'O' ? 2 : 0;
+		if (*esc)
+			return -1;
+	}
+	if (*esc == 2) {
+		if (c < 0x40 || c > 0x7e)
+			return -1;
+		*esc = 0;
+		return c == 'A' ? IN_FLAP : IN_NONE;
+	}
+	if (c == 0x1b) {
+		*esc = 1;
+		return -1;
+	}
+	return c == 'q' ? IN_QUIT : IN_NONE;
+}
+
+/**
+ * Adds an event to a ring. Only ever called by the ring's producer thread.
+ *
+ * @param r
+ * @param e
+ *
+ * @return 1 on success, 0 if the ring is full and the event was dropped.
+ */
+int ring_push(input_ring *r, input_event e) {
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+	if (head - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+			INPUT_RING_LEN)
+		return 0;
+	r->events[head % INPUT_RING_LEN] = e;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return 1;
+}
+
+/**
+ * Takes the oldest event from a ring. Only ever called by the ring's
+ * consumer thread, and never blocks.
+ *
+ * @param r
+ * @param[out] e
+ *
+ * @return 1 on success, 0 if the ring is empty.
+ */
+int ring_pop(input_ring *r, input_event *e) {
+	unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	if (tail == atomic_load_explicit(&r->head, memory_order_acquire))
+		return 0;
+	*e = r->events[tail % INPUT_RING_LEN];
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+	return 1;
+}
+
+/**
+ * Hands a keystroke or resize from the input thread to the game.
+ *
+ * @param k
+ * @param time When it was read, as returned by now_ns().
+ * @param in
+ * @param rows New size of the terminal, for IN_RESIZE.
+ * @param cols
+ */
+void key_event(key_reader *k, long long time, input in, int rows, int cols) {
+	input_event e = { time, in, rows, cols };
+
+	// The pipe only fills up if nobody's waiting, so a failed write is fine.
+	if (ring_push(&k->ring, e) && write(k->wake[1], "", 1) < 0)
+		return;
+}
+
+/**
+ * Body of the input thread: reads the keyboard and watches the terminal's
+ * size until told to stop. Only this thread takes SIGWINCH, so that a resize
+ * interrupts its poll().
+ *
+ * @param arg The key_reader.
+ *
+ * @return NULL.
+ */
+void *key_reader_main(void *arg) {
+	key_reader *k = arg;
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	struct winsize ws;
+	unsigned char buf[64];
+	int esc = 0, rows = k->rows, cols = k->cols, in;
+	long long now;
+	sigset_t winch;
+	ssize_t n, i;
+
+	sigemptyset(&winch);
+	sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+
+	while (!atomic_load(&k->stop)) {
+		if (poll(&pfd, 1, KEY_POLL_MS) > 0) {
+			if ((n = read(STDIN_FILENO, buf, sizeof(buf))) == 0) {
+				key_event(k, now_ns(), IN_QUIT, 0, 0); // The terminal's gone.
+				break;
+			}
+			now = now_ns();
+			for (i = 0; i < n; i++)
+				if ((in = parse_key(&esc, buf[i])) >= 0)
+					key_event(k, now, in, 0, 0);
+		}
+		if (!ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) &&
+				(ws.ws_row != rows || ws.ws_col != cols)) {
+			rows = ws.ws_row;
+			cols = ws.ws_col;
+			key_event(k, now_ns(), IN_RESIZE, rows, cols);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Starts reading the keyboard on its own thread, after curses_init(). From
+ * then on keystrokes reach the game only through 'keys'.
+ */
+void key_reader_start() {
+	sigset_t winch;
+
+	if (pipe(keys.wake)) {
+		perror("pipe");
+		return;
+	}
+	fcntl(keys.wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(keys.wake[1], F_SETFL, O_NONBLOCK);
+	keys.rows = LINES;
+	keys.cols = COLS;
+	atomic_init(&keys.stop, 0);
+
+	// Resizes go to the input thread, which unblocks them for itself.
+	sigemptyset(&winch);
+	sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_BLOCK, &winch, NULL);
+	if (pthread_create(&keys.thread, NULL, key_reader_main, &keys)) {
+		pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+		close(keys.wake[0]);
+		close(keys.wake[1]);
+		return;
+	}
+	keys_threaded = 1;
+}
+
+/**
+ * Stops the input thread, if it was started.
+ */
+void key_reader_stop() {
+	sigset_t winch;
+
+	if (!keys_threaded)
+		return;
+	atomic_store(&keys.stop, 1);
+	pthread_join(keys.thread, NULL);
+	close(keys.wake[0]);
+	close(keys.wake[1]);
+	keys_threaded = 0;
+
+	sigemptyset(&winch);
+	sigaddset(&winch, SIGWINCH);
+	pthread_sigmask(SIG_UNBLOCK, &winch, NULL);
+}
+
+/**
+ * Takes the next event from the input thread, first resizing ncurses' idea
+ * of the terminal if that's what it was.
+ *
+ * @param[out] e
+ *
+ * @return 1 on success, 0 if there are no events.
+ */
+int key_reader_pop(input_event *e) {
+	if (!ring_pop(&keys.ring, e))
+		return 0;
+	if (e->in == IN_RESIZE)
+		resizeterm(e->rows, e->cols);
+	return 1;
+}
+
+/**
+ * Throws away the keys that haven't been read yet, e.g. the flaps pressed
+ * while Flappy was going down, but not a quit among them.
+ *
+ * @return 1 if one of the keys was a quit, 0 otherwise.
+ */
+int input_flush() {
+	input_event e;
+	int ch = ERR, quit = 0;
+
+	while (keys_threaded ? key_reader_pop(&e) : (ch = getch()) != ERR)
+		quit |= (keys_threaded ? e.in : read_input(ch)) == IN_QUIT;
+	return quit;
+}
+
+/**
+ * Waits for a key press without spinning, or until a deadline passes. Uses no
+ * CPU while waiting. A terminal resize counts as a key (KEY_RESIZE), since
+ * the signal interrupts the wait. Expects getch() not to block.
+ *
+ * @param deadline As returned by now_ns(), or -1 to wait for a key forever.
+ *
+ * @return The key, or ERR if the deadline passed first.
+ */
+int wait_for_key(long long deadline) {
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	long long left;
+	int ch;
+	input_event e;
+	char drain[64];
+
+	// The input thread wakes us through its pipe.
+	if (keys_threaded) {
+		pfd.fd = keys.wake[0];
+		while (!key_reader_pop(&e)) {
+			left = deadline < 0 ? -1 : deadline - now_ns();
+			if (deadline >= 0 && left <= 0)
+				return ERR;
+			poll(&pfd, 1, left < 0 ? -1 : (int) ((left + 999999) / 1000000));
+			while (read(pfd.fd, drain, sizeof(drain)) > 0)
+				;
+		}
+		switch (e.in) {
+		case IN_QUIT:
+			return 'q';
+		case IN_FLAP:
+			return KEY_UP;
+		case IN_RESIZE:
+			return KEY_RESIZE;
+		default:
+			return ' ';
+		}
+	}
+
+	// ncurses may already hold keys it read ahead, so ask it first.
+	while ((ch = getch()) == ERR) {
+		left = deadline < 0 ? -1 : deadline - now_ns();
+		if (deadline >= 0 && left <= 0)
+			return ERR;
+		poll(&pfd, 1, left < 0 ? -1 : (int) ((left + 999999) / 1000000));
+	}
+	return ch;
+}
+
+/**
+ * Reads every keystroke that has arrived into the queue, stamping up-arrow
+ * presses with the time they were read. With the input thread this only
+ * takes what it has already read and stamped.
+ *
+ * @param q
+ */
+void input_drain(input_queue *q) {
+	input_event e = { 0, IN_NONE, 0, 0 };
+	int ch = ERR;
+
+	while (keys_threaded ? key_reader_pop(&e) : (ch = getch()) != ERR) {
+		if (!keys_threaded) {
+			e.in = read_input(ch);
+			e.time = now_ns();
+		}
+		switch (e.in) {
+		case IN_FLAP:
+			// Presses beyond what the queue holds would only repeat flaps
+			// that are already waiting.
+			if (q->count < INPUT_QUEUE_LEN)
+				q->flaps[(q->first + q->count++) % INPUT_QUEUE_LEN] = e.time;
+			break;
+		case IN_QUIT:
+			q->quit = 1;
+			break;
+		case IN_RESIZE:
+			q->resized = 1;
+			break;
+		case IN_NONE:
+			break;
+		}
+	}
+}
+
+/**
+ * Waits until the given deadline, reading keystrokes into the queue the
+ * moment they arrive. Returns early if the user quits or resizes the
+ * terminal.
+ *
+ * @param q
+ * @param deadline As returned by now_ns().
+ */
+void input_wait(input_queue *q, long long deadline) {
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	long long left;
+	int ready;
+
+	// The input thread does the waiting on the keyboard.
+	if (keys_threaded) {
+		sleep_until(deadline);
+		PROFILE_SKIP();
+		input_drain(q);
+		return;
+	}
+
+	// Only the reading is charged to PH_INPUT, not the waiting.
+	input_drain(q);
+	while (!q->quit && !q->resized && (left = deadline - now_ns()) > 0) {
+		PROFILE_MARK(PH_INPUT);
+
+		// poll() only counts whole milliseconds, so sleep out the rest.
+		if (left < NSEC_PER_SEC / 1000) {
+			sleep_until(deadline);
+			PROFILE_SKIP();
+			input_drain(q);
+			break;
+		}
+		ready = poll(&pfd, 1, left / (NSEC_PER_SEC / 1000));
+		PROFILE_SKIP();
+		if (ready > 0)
+			input_drain(q);
+	}
+}
+
+/**
+ * Takes the up-arrow presses that a tick should act on: the ones read by the
+ * time the tick was due. Later ones wait for a later tick, even when ticks
+ * are being caught up on.
+ *
+ * @param q
+ * @param due When the tick was due, as returned by now_ns().
+ *
+ * @return 1 if Flappy should flap on this tick.
+ */
+int input_flap(input_queue *q, long long due) {
+	int flap = 0;
+
+	while (q->count && q->flaps[q->first] <= due) {
+		q->first = (q->first + 1) % INPUT_QUEUE_LEN;
+		q->count--;
+		flap = 1;
+	}
+	return flap;
+}
+
+/**
+ * Writes an unsigned LEB128 varint: 7 bits per byte, low bits first, with the
+ * high bit set on every byte but the last.
+ *
+ * @param out
+ * @param x
+ */
+void write_varint(FILE *out, uint64_t x) {
+	while (x >= 0x80) {
+		fputc((x & 0x7f) | 0x80, out);
+		x >>= 7;
+	}
+	fputc(x, out);
+}
+
+/**
+ * Reads a varint written by write_varint().
+ *
+ * @param in
+ * @param[out] x
+ *
+ * @return 1 on success, 0 at end of file or if the varint was cut short.
+ */
+int read_varint(FILE *in, uint64_t *x) {
+	int c, shift;
+
+	*x = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		if ((c = fgetc(in)) == EOF)
+			return 0;
+		*x |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Creates a replay file and writes its header.
+ *
+ * @param[out] rec
+ * @param path
+ * @param seed Seed the session is played with.
+ * @param counter_rng Whether the session uses counter mode.
+ * @param rows Size of the world at the start of the session.
+ * @param cols
+ *
+ * @return 0 on success, -1 with errno set if the file can't be created.
+ */
+int recorder_open(recorder *rec, const char *path, uint64_t seed,
+		int counter_rng, int rows, int cols) {
+	if (!(rec->out = fopen(path, "wb")))
+		return -1;
+	fwrite(REPLAY_MAGIC, 1, sizeof(REPLAY_MAGIC), rec->out);
+	fputc(REPLAY_VERSION, rec->out);
+	fputc(counter_rng ? 1 : 0, rec->out);
+	write_varint(rec->out, seed);
+	write_varint(rec->out, rows);
+	write_varint(rec->out, cols);
+	rec->last_tick = 0;
+	return 0;
+}
+
+/**
+ * Records an event.
+ *
+ * @param rec
+ * @param tick Tick of the current game the event happened at.
+ * @param kind
+ */
+void recorder_event(recorder *rec, int tick, replay_event kind) {
+	write_varint(rec->out,
+			(uint64_t) (tick - rec->last_tick) << REPLAY_KIND_BITS | kind);
+	rec->last_tick = kind == EV_END ? 0 : tick;
+}
+
+/**
+ * Records that the player quit mid-game. The game ends on the last tick
+ * played, so a replay doesn't simulate one more, unless a resize has been
+ * recorded for the tick that didn't run yet.
+ *
+ * @param rec
+ * @param ticks Ticks the current game has run for.
+ */
+void recorder_quit(recorder *rec, int ticks) {
+	recorder_event(rec, ticks > rec->last_tick ? ticks - 1 : rec->last_tick,
+			EV_END);
+}
+
+/**
+ * Records a resize of the world.
+ *
+ * @param rec
+ * @param tick Tick of the current game the resize happened at.
+ * @param rows New size of the world.
+ * @param cols
+ */
+void recorder_resize(recorder *rec, int tick, int rows, int cols) {
+	recorder_event(rec, tick, EV_RESIZE);
+	write_varint(rec->out, rows);
+	write_varint(rec->out, cols);
+}
+
+/**
+ * Finishes a replay file.
+ *
+ * @param rec
+ */
+void recorder_close(recorder *rec) {
+	fclose(rec->out);
+}
+
+/**
+ * Reads the next event of a replay, or sets rp->done if there are none.
+ *
+ * @param rp
+ */
+void replay_advance(replay *rp) {
+	uint64_t x, rows, cols;
+	int base = rp->next_kind == EV_END ? 0 : rp->next_tick;
+
+	if (!read_varint(rp->in, &x)) {
+		rp->done = 1;
+		return;
+	}
+	rp->next_kind = x & ((1 << rp->kind_bits) - 1);
+	rp->next_tick = base + (int) (x >> rp->kind_bits);
+	if (rp->next_kind == EV_RESIZE) {
+		if (!read_varint(rp->in, &rows) || !read_varint(rp->in, &cols)) {
+			rp->done = 1;
+			return;
+		}
+		rp->next_rows = rows;
+		rp->next_cols = cols;
+	}
+}
+
+/**
+ * Opens a replay file and reads its header and first event.
+ *
+ * @param[out] rp
+ * @param path
+ *
+ * @return 0 on success, -1 if the file can't be read or isn't a replay.
+ */
+int replay_open(replay *rp, const char *path) {
+	char magic[sizeof(REPLAY_MAGIC)];
+	int version, flags;
+	uint64_t rows = NUM_ROWS, cols = NUM_COLS;
+
+	if (!(rp->in = fopen(path, "rb")))
+		return -1;
+	if (fread(magic, 1, sizeof(magic), rp->in) != sizeof(magic) ||
+			memcmp(magic, REPLAY_MAGIC, sizeof(magic)) ||
+			(version = fgetc(rp->in)) < 1 || version > REPLAY_VERSION ||
+			(flags = fgetc(rp->in)) == EOF ||
+			!read_varint(rp->in, &rp->seed) ||
+			(version >= 2 && (!read_varint(rp->in, &rows) ||
+			!read_varint(rp->in, &cols)))) {
+		fclose(rp->in);
+		errno = EINVAL;
+		return -1;
+	}
+	rp->counter_rng = flags & 1;
+	rp->rows = rows;
+	rp->cols = cols;
+	rp->kind_bits = version >= 2 ? REPLAY_KIND_BITS : 1;
+	rp->done = 0;
+
+	// Start as if a game just ended, so the first event counts from tick 0.
+	rp->next_kind = EV_END;
+	replay_advance(rp);
+	return 0;
+}
+
+/**
+ * Checks whether the world was resized at the given tick of a replay,
+ * consuming the event if so.
+ *
+ * @param rp
+ * @param tick Tick of the current game.
+ * @param[out] rows Receives the new size of the world.
+ * @param[out] cols
+ *
+ * @return 1 if the world was resized, 0 otherwise.
+ */
+int replay_resize(replay *rp, int tick, int *rows, int *cols) {
+	if (rp->done || rp->next_kind != EV_RESIZE || rp->next_tick != tick)
+		return 0;
+	*rows = rp->next_rows;
+	*cols = rp->next_cols;
+	replay_advance(rp);
+	return 1;
+}
+
+/**
+ * Checks whether Flappy flapped at the given tick of a replay, consuming the
+ * event if so.
+ *
+ * @param rp
+ * @param tick Tick of the current game.
+ *
+ * @return 1 to flap, 0 otherwise.
+ */
+int replay_flap(replay *rp, int tick) {
+	if (rp->done || rp->next_kind != EV_FLAP || rp->next_tick != tick)
+		return 0;
+	replay_advance(rp);
+	return 1;
+}
+
+/**
+ * Checks whether the current game of a replay ended at the given tick,
+ * consuming the event if so. A replay that runs out of events mid-game is
+ * treated as ending there.
+ *
+ * @param rp
+ * @param tick Tick of the current game.
+ *
+ * @return 1 if the game ended, 0 otherwise.
+ */
+int replay_game_over(replay *rp, int tick) {
+	if (rp->done)
+		return 1;
+	if (rp->next_kind != EV_END || rp->next_tick != tick)
+		return 0;
+	replay_advance(rp);
+	return 1;
+}
+
+/**
+ * Closes a replay file.
+ *
+ * @param rp
+ */
+void replay_close(replay *rp) {
+	fclose(rp->in);
+}
+
+/** The policies there are, by name. The first is the default. */
+const policy POLICIES[] = {
+	{ "simple", autopilot_flap },
+	{ "lookahead", lookahead_flap },
+};
+
+/**
+ * Looks up a policy by name.
+ *
+ * @param name
+ *
+ * @return The policy, or NULL if there's none by that name.
+ */
+policy_fn find_policy(const char *name) {
+	size_t i;
+
+	for (i = 0; i < sizeof(POLICIES) / sizeof(POLICIES[0]); i++)
+		if (!strcmp(POLICIES[i].name, name))
+			return POLICIES[i].fn;
+	return NULL;
+}
+
+/**
+ * Draws the current state of the world and displays it.
+ *
+ * @param g
+ */
+void render_frame(game *g) {
+	compose_frame(&fb, g);
+	PROFILE_OVERLAY(g);
+	PROFILE_MARK(PH_DRAW);
+
+	// Send only the changed cells to the terminal.
+	fb_flush();
+	refresh();
+	PROFILE_MARK(PH_REFRESH);
+}
+
+/**
+ * Takes over the terminal with ncurses. Afterwards LINES and COLS hold its
+ * size.
+ */
+void curses_init() {
+	initscr();
+	raw();					// Disable line buffering
+	keypad(stdscr, TRUE);
+	noecho();				// Don't echo() for getch
+	curs_set(0);
+	timeout(0);
+}
+
+/**
+ * Adapts to a new terminal size: rebuilds the frame buffer so the next frame
+ * repaints the whole screen.
+ */
+void screen_resized() {
+	fb_init(LINES, COLS);
+	screen_clear();
+}
+
+/**
+ * Resizes the world of a game, as played and as replayed. A game that hasn't
+ * had its first tick yet, such as one about to start after a resize on the
+ * game over screen, is started over at the new size instead, so it gets as
+ * many pipes as suit it. Either way a replay does the same at the same tick.
+ *
+ * @param g
+ * @param rows
+ * @param cols
+ */
+void world_resize(game *g, int rows, int cols) {
+	game_resize(g, rows, cols);
+	if (!g->ticks)
+		reset_world(g);
+}
+
+/**
+ * Resizes the world to match the frame buffer, recording the resize at the
+ * current tick. Not for replays, which dictate the size of the world.
+ *
+ * @param g
+ * @param rec If not NULL, the resize is recorded here.
+ */
+void world_resized(game *g, recorder *rec) {
+	world_resize(g, fb.rows, fb.cols);
+	if (rec)
+		recorder_resize(rec, g->ticks, fb.rows, fb.cols);
+}
+
+/**
+ * Plays the game in the terminal until the user quits, or shows a replay in
+ * real time until it runs out. The terminal must already be set up with
+ * curses_init(). The session is a state machine (see play_state) stepped by
+ * this loop; nothing in it blocks except waiting for the next tick or, at
+ * game over, for a key.
+ *
+ * @param g A freshly initialized game.
+ * @param rec If not NULL, every flap and game over is recorded here.
+ * @param rp If not NULL, flaps come from this replay instead of the keyboard.
+ * @param restart_ns After game over, start the next game by itself after
+ * this long. If negative, wait for a key.
+ * @param splash If nonzero, start with the splash screen.
+ */
+void play_interactive(game *g, recorder *rec, replay *rp,
+		long long restart_ns, int splash) {
+	play_state state = splash && !rp ? ST_SPLASH : ST_RESTART;
+	int ticks, tick, flap, over, quit, rows, cols, ch, filled, stale = 0;
+	input_queue q = { { 0 }, 0, 0, 0, 0 };
+	death d;
+	long long tick_ns = NSEC_PER_SEC / TARGET_FPS;
+	long long next_tick = 0, deadline = -1;
+	long long splash_start = now_ns();
+	long long bar_ns = START_TIME_SEC * NSEC_PER_SEC / PROG_BAR_LEN;
+
+	fb_init(LINES, COLS);
+
+	while(1) {
+		switch (state) {
+		case ST_SPLASH:
+			// Fill the progress bar a cell at a time, then hold it for a
+			// moment. Any key skips the rest, and 'q' quits.
+			filled = (now_ns() - splash_start) / bar_ns;
+			splash_screen(filled);
+			deadline = splash_start + (filled < PROG_BAR_LEN ?
+					(filled + 1) * bar_ns : PROG_BAR_LEN * bar_ns +
+					SPLASH_HOLD_NS);
+			ch = wait_for_key(deadline);
+			if (ch == 'q')
+				return;
+			if (ch == KEY_RESIZE) {
+				screen_resized();
+				world_resized(g, rec);
+			}
+			else if (ch != ERR || filled >= PROG_BAR_LEN)
+				state = ST_RESTART;
+			break;
+
+		case ST_RESTART:
+			// The terminal may have been resized since the last game. The
+			// world follows only now, at tick 0 of the new game, which is
+			// started over at the new size; a replay does it at the same
+			// moment.
+			if (LINES != fb.rows || COLS != fb.cols) {
+				screen_resized();
+				stale = 1;
+			}
+			if (stale && !rp)
+				world_resized(g, rec);
+			stale = 0;
+
+			// Start from a blank screen that the renderer knows about.
+			screen_clear();
+
+			// Schedule the first tick one period from now, with no keys
+			// carried over from before the game.
+			next_tick = now_ns() + tick_ns;
+			q.count = 0;
+			state = ST_PLAYING;
+			break;
+
+		case ST_DEAD:
+			ch = wait_for_key(deadline);
+			if (ch == 'q')
+				return;
+			if (ch == KEY_RESIZE) {
+				screen_resized();
+				stale = 1;
+				if (rp)
+					render_frame(g);
+				else
+					failure_screen();
+				continue;
+			}
+
+			// A replay moves on only when its pause is over.
+			if (rp && ch != ERR)
+				continue;
+			if (rp && rp->done)
+				return;
+			reset_world(g);
+			state = ST_RESTART;
+			break;
+
+		case ST_PLAYING:
+			// Keys are read the moment they arrive while waiting for the
+			// tick, so each applies to the tick it was pressed before.
+			PROFILE_START();
+			input_wait(&q, next_tick);
+			if (q.quit) {
+				if (rec)
+					recorder_quit(rec, g->ticks);
+				return;
+			}
+			if (q.resized) {
+				q.resized = 0;
+				screen_resized();
+				if (!rp)
+					world_resized(g, rec);
+			}
+			PROFILE_MARK(PH_INPUT);
+
+			// Run every physics tick that has come due. If the last frame ran
+			// late this runs several ticks back-to-back and skips drawing the
+			// ones in between, so gameplay speed doesn't depend on how long
+			// the terminal takes to render.
+			for (ticks = 0; ticks < MAX_CATCHUP_TICKS &&
+					now_ns() >= next_tick; ticks++) {
+				tick = g->ticks;
+				if (rp && replay_resize(rp, tick, &rows, &cols))
+					world_resize(g, rows, cols);
+				flap = input_flap(&q, next_tick);
+				next_tick += tick_ns;
+				if (rp)
+					flap = replay_flap(rp, tick);
+				else if (bot)
+					flap = bot(g);
+				if (rec && flap)
+					recorder_event(rec, tick, EV_FLAP);
+				d = physics_tick(g, flap);
+				over = rp ? replay_game_over(rp, tick) : d != ALIVE;
+				PROFILE_MARK(PH_SIM);
+				if (!over)
+					continue;
+
+				// The game is over. A replay leaves its end up for a moment;
+				// a player gets the failure screen, minus any flaps pressed
+				// while Flappy was going down, unless they pressed 'q' then.
+				if (rec)
+					recorder_event(rec, tick, EV_END);
+				if (rp) {
+					render_frame(g);
+					deadline = now_ns() + REPLAY_PAUSE_NS;
+				}
+				else {
+					quit = input_flush();
+					post_score(g, getuid());
+					if (quit)
+						return;
+					failure_screen();
+					deadline = restart_ns < 0 ? -1 : now_ns() + restart_ns;
+				}
+				end_game(g);
+				state = ST_DEAD;
+				break;
+			}
+			if (state != ST_PLAYING)
+				break;
+
+			// Hopelessly behind (e.g. the process was stopped), so don't try
+			// to replay all the missed ticks.
+			if (now_ns() >= next_tick)
+				next_tick = now_ns() + tick_ns;
+
+			render_frame(g);
+			PROFILE_END();
+			break;
+		}
+	}
+}
+
+/**
+ * Plays one game with the autopilot, or the bot if there is one, at the
+ * controls.
+ *
+ * @param seed Seed for the pipe openings.
+ * @param counter_rng If nonzero, draw pipe openings in counter mode.
+ * @param max_frames Give up on the game after this many frames.
+ * @param[out] r Receives the outcome.
+ */
+void play_headless_game(uint64_t seed, int counter_rng, int max_frames,
+		result *r) {
+	game g;
+
+	game_init(&g, seed, counter_rng, NUM_ROWS, NUM_COLS);
+	r->cause = ab_play(&g, bot ? bot : autopilot_flap, max_frames);
+	r->score = g.score;
+	r->frames = g.ticks;
+}
+
+/**
+ * Prints the results of a run of headless games.
+ *
+ * @param results One per game.
+ * @param games Number of games.
+ * @param seed Seed of game 0, so the run can be reproduced.
+ * @param secs Wall-clock time the run took.
+ * @param verbose If nonzero, print the outcome of every game.
+ */
+void report_results(const result *results, int games, uint64_t seed,
+		double secs, int verbose) {
+	int g, min_score = INT_MAX, max_score = 0;
+	int causes[DIED_PIPE + 1] = { 0 };
+	long long total_frames = 0, total_score = 0;
+
+	for (g = 0; g < games; g++) {
+		if (verbose)
+			printf("game %d: score %d, %d frames, %s\n", g,
+					results[g].score, results[g].frames,
+					DEATH_NAMES[results[g].cause]);
+		total_frames += results[g].frames;
+		total_score += results[g].score;
+		if (results[g].score < min_score)
+			min_score = results[g].score;
+		if (results[g].score > max_score)
+			max_score = results[g].score;
+		causes[results[g].cause]++;
+	}
+
+	printf("%d games, %lld frames in %.3f s (%.0f frames/s)\n",
+			games, total_frames, secs, total_frames / secs);
+	printf("seed: %llu\n", (unsigned long long) seed);
+	if (games > 0) {
+		printf("scores: min %d, mean %.2f, max %d\n", min_score,
+				total_score / (double) games, max_score);
+		printf("deaths: %d pipe, %d ceiling, %d floor, %d still alive\n",
+				causes[DIED_PIPE], causes[DIED_CEILING], causes[DIED_FLOOR],
+				causes[ALIVE]);
+	}
+}
+
+/**
+ * Plays a replay back without a terminal, as fast as possible, and reports
+ * the outcome of every recorded game. Games whose recorded ending doesn't
+ * match the simulation are flagged. If capturing (see cast), every frame is
+ * drawn and captured as if the replay were being watched.
+ *
+ * @param rp
+ * @param verbose If nonzero, print the outcome of every game.
+ *
+ * @return Number of games that did not play out as recorded.
+ */
+int run_replay(replay *rp, int verbose) {
+	game g;
+	int tick, over, games = 0, cap = 16, mismatches = 0, rows, cols;
+	result *results = malloc(cap * sizeof(result));
+	long long start = now_ns(), shot = 0;
+	death d;
+
+	assert(results);
+	game_init(&g, rp->seed, rp->counter_rng, rp->rows, rp->cols);
+	if (cast)
+		fb_init(rp->rows, rp->cols);
+	while (!rp->done) {
+		tick = g.ticks;
+		if (replay_resize(rp, tick, &rows, &cols)) {
+			world_resize(&g, rows, cols);
+			if (cast)
+				fb_init(rows, cols);
+		}
+		d = physics_tick(&g, replay_flap(rp, tick));
+		over = replay_game_over(rp, tick);
+
+		// Captured frames are stamped with the time they'd be shown at when
+		// played back in real time, ending on the same pause.
+		if (cast) {
+			compose_frame(&fb, &g);
+			capture_frame(cast, shot);
+			shot += over ? REPLAY_PAUSE_NS : NSEC_PER_SEC / TARGET_FPS;
+		}
+		if (d == ALIVE && !over)
+			continue;
+
+		// Only the last game can end without Flappy dying, by quitting.
+		if (d == ALIVE ? !rp->done : !over) {
+			fprintf(stderr, "game %d: replay diverges at tick %d\n",
+					games, tick);
+			mismatches++;
+		}
+
+		if (games == cap) {
+			results = realloc(results, (cap *= 2) * sizeof(result));
+			assert(results);
+		}
+		results[games].score = g.score;
+		results[games].frames = tick + 1;
+		results[games].cause = d;
+		games++;
+		end_game(&g);
+		reset_world(&g);
+
+		// If the game kept going past the recorded end, the events after it
+		// belong to the next game, so they can't be salvaged.
+		if (!over)
+			break;
+	}
+
+	report_results(results, games, rp->seed,
+			(now_ns() - start) / (double) NSEC_PER_SEC, verbose);
+	free(results);
+	return mismatches;
+}
+
+/**
+ * Packs [lo, hi) into a game_range.
+ *
+ * @param lo
+ * @param hi
+ *
+ * @return The range.
+ */
+static inline game_range make_range(uint32_t lo, uint32_t hi) {
+	return (game_range) hi << 32 | lo;
+}
+
+static inline uint32_t range_lo(game_range r) { return (uint32_t) r; }
+
+static inline uint32_t range_hi(game_range r) { return r >> 32; }
+
+/**
+ * Takes the next game off the bottom of a worker's own range.
+ *
+ * @param w
+ *
+ * @return The game number, or -1 if the range is empty.
+ */
+long worker_pop(worker *w) {
+	game_range r = atomic_load(&w->todo);
+	while (range_lo(r) < range_hi(r)) {
+		if (atomic_compare_exchange_weak(&w->todo, &r,
+				make_range(range_lo(r) + 1, range_hi(r))))
+			return range_lo(r);
+	}
+	return -1;
+}
+
+/**
+ * Steals the top half of some other worker's range into w's range, which
+ * must be empty. Victims are visited round-robin starting at a random one.
+ *
+ * @param w The thief.
+ *
+ * @return 1 if anything was stolen, 0 if every other worker is out of work.
+ */
+int worker_steal(worker *w) {
+	pool *p = w->pool;
+	int i, start = rng_next(&w->rng) % p->num_workers;
+	uint32_t lo, hi, mid;
+	worker *victim;
+	game_range r;
+
+	for (i = 0; i < p->num_workers; i++) {
+		victim = &p->workers[(start + i) % p->num_workers];
+		if (victim == w)
+			continue;
+		r = atomic_load(&victim->todo);
+		while ((lo = range_lo(r)) < (hi = range_hi(r))) {
+			mid = hi - (hi - lo + 1) / 2;
+			if (atomic_compare_exchange_weak(&victim->todo, &r,
+					make_range(lo, mid))) {
+				atomic_store(&w->todo, make_range(mid, hi));
+				w->steals++;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Thread body of a worker: plays games from its own range and steals more
+ * when it runs dry, until there are none left anywhere. Work is only ever
+ * split, never added, so a full sweep that finds nothing means deciding to
+ * stop is safe.
+ *
+ * @param arg The worker.
+ *
+ * @return NULL
+ */
+void *worker_run(void *arg) {
+	worker *w = arg;
+	pool *p = w->pool;
+	long g;
+
+	do {
+		while ((g = worker_pop(w)) >= 0) {
+			play_headless_game(p->base_seed + g, p->counter_rng,
+					p->max_frames, &p->results[g]);
+			w->played++;
+		}
+	} while (worker_steal(w));
+	return NULL;
+}
+
+/**
+ * Simulates games as fast as possible with the autopilot at the controls and
+ * without touching the terminal, then reports how fast that went. The games
+ * are split evenly across the threads up front, and threads that finish
+ * early steal from the ones that haven't.
+ *
+ * @param games Number of games to play.
+ * @param threads Number of worker threads.
+ * @param seed Game g is seeded with seed + g.
+ * @param counter_rng If nonzero, draw pipe openings in counter mode.
+ * @param max_frames Give up on a game after this many frames.
+ * @param verbose If nonzero, print the outcome of every game.
+ */
+void run_headless(int games, int threads, uint64_t seed, int counter_rng,
+		int max_frames, int verbose) {
+	pool p;
+	int i;
+	long long start = now_ns();
+
+	p.num_workers = threads < 1 ? 1 : threads;
+	p.workers = calloc(p.num_workers, sizeof(worker));
+	p.results = malloc(games * sizeof(result));
+	p.base_seed = seed;
+	p.counter_rng = counter_rng;
+	p.max_frames = max_frames;
+	assert(p.workers && p.results);
+
+	for (i = 0; i < p.num_workers; i++) {
+		p.workers[i].id = i;
+		p.workers[i].pool = &p;
+		rng_seed(&p.workers[i].rng, i);
+		atomic_init(&p.workers[i].todo,
+				make_range((long long) games * i / p.num_workers,
+				(long long) games * (i + 1) / p.num_workers));
+	}
+
+	// Worker 0 runs on this thread.
+	for (i = 1; i < p.num_workers; i++)
+		pthread_create(&p.workers[i].thread, NULL, worker_run, &p.workers[i]);
+	worker_run(&p.workers[0]);
+	for (i = 1; i < p.num_workers; i++)
+		pthread_join(p.workers[i].thread, NULL);
+
+	report_results(p.results, games, seed, (now_ns() - start) /
+			(double) NSEC_PER_SEC, verbose);
+	if (verbose && p.num_workers > 1)
+		for (i = 0; i < p.num_workers; i++)
+			printf("thread %d: %d games, %d steals\n", i,
+					p.workers[i].played, p.workers[i].steals);
+
+	free(p.workers);
+	free(p.results);
+}
+
+/**
+ * Starts a new game in a slot of a batch.
+ *
+ * @param b
+ * @param i The slot.
+ * @param seed Seed for the game's pipe openings.
+ */
+void batch_start(batch *b, int i, uint64_t seed) {
+	// Same starting positions as reset_world().
+	b->seed[i] = seed;
+	b->pipes_drawn[i] = 2;
+	b->y[i] = NUM_ROWS / 2 * ROW_SCALE;
+	b->v[i] = V0 + GRAV / 2;
+	b->center[0][i] = pipe_start(NUM_COLS, 0);
+	b->opening_height[0][i] = pipe_opening_height(seed, 0);
+	b->center[1][i] = pipe_start(NUM_COLS, 1);
+	b->opening_height[1][i] = pipe_opening_height(seed, 1);
+	b->score[i] = 0;
+	b->frames[i] = 0;
+	b->dead[i] = ALIVE;
+}
+
+/**
+ * Allocates a batch of games, all ready to start.
+ *
+ * @param n Number of slots.
+ * @param seed Game i is seeded with seed + i, like in run_headless().
+ * @param max_frames A game is finished after this many frames.
+ *
+ * @return The batch; free it with batch_free().
+ */
+batch *batch_new(int n, uint64_t seed, int max_frames) {
+	int i;
+	batch *b = malloc(sizeof(batch));
+
+	// A batched game has room for two pipes, which is how many a headless
+	// game gets with every preset.
+	assert(pipe_count(NUM_COLS) == 2);
+	assert(b);
+	b->n = n;
+	b->max_frames = max_frames;
+	b->y = malloc(n * sizeof(int));
+	b->v = malloc(n * sizeof(int));
+	for (i = 0; i < 2; i++) {
+		b->center[i] = malloc(n * sizeof(int));
+		b->opening_height[i] = malloc(n * sizeof(float));
+		assert(b->center[i] && b->opening_height[i]);
+	}
+	b->score = malloc(n * sizeof(int));
+	b->frames = malloc(n * sizeof(int));
+	b->dead = malloc(n * sizeof(int));
+	b->seed = malloc(n * sizeof(uint64_t));
+	b->pipes_drawn = malloc(n * sizeof(int));
+	b->flap = malloc(n * sizeof(int));
+	b->wrapped = malloc(n * sizeof(int));
+	assert(b->y && b->v && b->score && b->frames && b->dead && b->seed &&
+			b->pipes_drawn && b->flap && b->wrapped);
+
+	for (i = 0; i < n; i++)
+		batch_start(b, i, seed + i);
+	return b;
+}
+
+/**
+ * Frees a batch made by batch_new().
+ *
+ * @param b
+ */
+void batch_free(batch *b) {
+	int i;
+	free(b->y);
+	free(b->v);
+	for (i = 0; i < 2; i++) {
+		free(b->center[i]);
+		free(b->opening_height[i]);
+	}
+	free(b->score);
+	free(b->frames);
+	free(b->dead);
+	free(b->seed);
+	free(b->pipes_drawn);
+	free(b->flap);
+	free(b->wrapped);
+	free(b);
+}
+
+/**
+ * Makes the autopilot_flap() decision for every game in the batch, into
+ * b->flap.
+ *
+ * @param b
+ */
+void batch_autopilot(batch *b) {
+	int i, n = b->n, h, next, b0, b1, bottom;
+	const int *restrict y = b->y, *restrict v = b->v;
+	const int *restrict c0 = b->center[0], *restrict c1 = b->center[1];
+	const float *restrict oh0 = b->opening_height[0];
+	const float *restrict oh1 = b->opening_height[1];
+	int *restrict flap = b->flap;
+
+	// Bitwise rather than short-circuit operators, and picking the next
+	// pipe's opening with a mask rather than ?:, keep the loop free of
+	// branches so it vectorizes.
+	for (i = 0; i < n; i++) {
+		h = y[i] / ROW_SCALE;
+		next = (c0[i] + PIPE_RADIUS + 1 < FLAPPY_COL) |
+				((c1[i] < c0[i]) & (c1[i] + PIPE_RADIUS + 1 >= FLAPPY_COL));
+		b0 = oh0[i] * (NUM_ROWS - 1) + OPENING_WIDTH / 2;
+		b1 = oh1[i] * (NUM_ROWS - 1) + OPENING_WIDTH / 2;
+		bottom = b0 ^ ((b0 ^ b1) & -next);
+		// v is V0 + GRAV * t + GRAV / 2, see flappy_launch().
+		flap[i] = (v[i] >= GRAV / 2) & (h >= bottom - 2);
+	}
+}
+
+/**
+ * Scrolls one pipe of every game in a batch and wraps the ones that left the
+ * screen on the left, like pipes_refresh().
+ *
+ * @param n Number of games.
+ * @param center The pipe's center in each game.
+ * @param opening_height The pipe's opening height in each game.
+ * @param score
+ * @param dead
+ * @param seed
+ * @param pipes_drawn
+ * @param wrapped Scratch space.
+ */
+void batch_pipe_refresh(int n, int *restrict center,
+		float *restrict opening_height, int *restrict score,
+		const int *restrict dead, const uint64_t *restrict seed,
+		int *restrict pipes_drawn, int *restrict wrapped) {
+	int i, wrap;
+
+	for (i = 0; i < n; i++) {
+		wrap = (dead[i] == ALIVE) & (center[i] + PIPE_RADIUS < 0);
+		wrapped[i] = wrap;
+		score[i] += wrap;
+		center[i] = wrap ? NUM_COLS + PIPE_RADIUS - 1 :
+				center[i] - (dead[i] == ALIVE);
+	}
+
+	// Wrapping happens once every few dozen ticks per pipe, so give the
+	// wrapped pipes new openings in a separate, mostly-skipped pass.
+	for (i = 0; i < n; i++)
+		if (wrapped[i])
+			opening_height[i] = pipe_opening_height(seed[i],
+					pipes_drawn[i]++);
+}
+
+/**
+ * Branch-free version of crashed_into_pipe() for batch_step().
+ *
+ * @param h Flappy's height.
+ * @param center The pipe's center.
+ * @param opening_height The pipe's opening height.
+ *
+ * @return 1 if Flappy crashed, 0 otherwise.
+ */
+static inline int batch_crashed_into_pipe(int h, int center,
+		float opening_height) {
+	int top = opening_height * (NUM_ROWS - 1) - OPENING_WIDTH / 2;
+	int bottom = opening_height * (NUM_ROWS - 1) + OPENING_WIDTH / 2;
+	return (FLAPPY_COL >= center - PIPE_RADIUS - 1) &
+			(FLAPPY_COL <= center + PIPE_RADIUS + 1) &
+			((h < top + 1) | (h > bottom - 1));
+}
+
 /**
- * Represents a vertical pipe through which Flappy The Bird is supposed to fly.
+ * Advances every game in the batch that is still in progress by one tick,
+ * exactly like physics_tick() does for a single game. Dead games are left as
+ * they are.
+ *
+ * @param b
+ * @param flap One flap decision per game.
+ *
+ * @return Number of games that finished this tick, by dying or by reaching
+ * b->max_frames, which marks them CALLED_OFF.
  */
-typedef struct vpipe {
-
-	/*
-	 * The height of the opening of the pipe as a fraction of the height of the
-	 * console window.
-	 */
-	float opening_height;
+int batch_step(batch *b, const int *flap) {
+	int i, n = b->n, h, alive, launch, hit, finished = 0;
+	int ceiling, ground, pipe, max_frames = b->max_frames;
+	int *restrict y = b->y, *restrict v = b->v;
+	int *restrict frames = b->frames, *restrict dead = b->dead;
+	const int *restrict c0 = b->center[0], *restrict c1 = b->center[1];
+	const float *restrict oh0 = b->opening_height[0];
+	const float *restrict oh1 = b->opening_height[1];
 
-	/*
-	 * Center of the pipe is at this column number (e.g. somewhere in [0, 79]).
-	 * When the center + radius is negative then the pipe's center is rolled
-	 * over to somewhere > the number of columns and the opening height is
-	 * changed.
-	 */
-	int center;
-} vpipe;
+	// Move Flappy along his parabola, or give him a boost.
+	for (i = 0; i < n; i++) {
+		alive = dead[i] == ALIVE;
+		launch = alive & flap[i];
+		h = y[i] / ROW_SCALE;
+		y[i] = launch ? h * ROW_SCALE : y[i] + alive * v[i];
+		v[i] = launch ? V0 + GRAV / 2 : v[i] + alive * GRAV;
+	}
 
-/** Represents Flappy the Bird. */
-typedef struct flappy {
-	/* Height of Flappy the Bird at the last up arrow press. */
-	int h0;
+	batch_pipe_refresh(n, b->center[0], b->opening_height[0], b->score, dead,
+			b->seed, b->pipes_drawn, b->wrapped);
+	batch_pipe_refresh(n, b->center[1], b->opening_height[1], b->score, dead,
+			b->seed, b->pipes_drawn, b->wrapped);
 
-	/* Time since last up arrow pressed. */
-	int t;
-} flappy;
+	// Check for collisions with the ceiling, the floor and both pipes. At
+	// most one of them counts and a game in progress is ALIVE, which is 0,
+	// so the death is a sum of masks rather than a chain of ?:. That keeps
+	// the loop free of branches so it vectorizes.
+	for (i = 0; i < n; i++) {
+		alive = dead[i] == ALIVE;
+		h = y[i] / ROW_SCALE;
+		ceiling = h <= 0;
+		ground = h >= NUM_ROWS - 1;
+		pipe = ((ceiling | ground) == 0) &
+				(batch_crashed_into_pipe(h, c0[i], oh0[i]) |
+				batch_crashed_into_pipe(h, c1[i], oh1[i]));
+		frames[i] += alive;
+		hit = ceiling * DIED_CEILING + ground * DIED_FLOOR + pipe * DIED_PIPE;
+		hit += ((hit == ALIVE) & (frames[i] >= max_frames)) * CALLED_OFF;
+		dead[i] += alive * hit;
+		finished += alive & (hit != ALIVE);
+	}
+	return finished;
+}
 
-//------------------------------ Global Constants -----------------------------
+/**
+ * Like run_headless(), but steps games in batches of structure-of-arrays
+ * state instead of one at a time. Finished games' slots are handed to the
+ * next games as they free up, so slots don't idle waiting for the slowest
+ * game.
+ * Pipe openings are always drawn in counter mode, so the results match
+ * run_headless() in counter mode.
+ *
+ * @param games Number of games to play.
+ * @param lanes Number of games stepped together.
+ * @param seed Game g is seeded with seed + g.
+ * @param max_frames Give up on a game after this many frames.
+ * @param verbose If nonzero, print the outcome of every game.
+ */
+void run_batch(int games, int lanes, uint64_t seed, int max_frames,
+		int verbose) {
+	batch *b;
+	int i, g, n = games < lanes ? games : lanes, next = n, playing = n;
+	int waiting = 0;
+	result *results = malloc(games * sizeof(result));
+	int *slot_game = malloc(n * sizeof(int));
+	long long start = now_ns();
 
-/** Gravitational acceleration constant */
-const float GRAV = 0.05;
+	assert(results && slot_game);
+	b = batch_new(n, seed, max_frames);
+	for (i = 0; i < n; i++)
+		slot_game[i] = i;
 
-/** Initial velocity with up arrow press */
-const float V0 = -0.5;
+	while (playing > 0) {
+		batch_autopilot(b);
+		waiting += batch_step(b, b->flap);
 
-/** Number of rows in the console window. */
-const int NUM_ROWS = 24;
+		// Finished games cost nothing while they wait, but scanning for them
+		// isn't free, so collect them and refill their slots in bulk.
+		if (waiting * BATCH_HARVEST < n && waiting < playing)
+			continue;
+		for (i = 0; i < n; i++) {
+			if ((g = slot_game[i]) < 0 || b->dead[i] == ALIVE)
+				continue;
+			results[g].score = b->score[i];
+			results[g].frames = b->frames[i];
+			results[g].cause = b->dead[i] == CALLED_OFF ? ALIVE : b->dead[i];
+			if (next < games) {
+				batch_start(b, i, seed + next);
+				slot_game[i] = next++;
+			}
+			else {
+				slot_game[i] = -1;
+				playing--;
+			}
+		}
+		waiting = 0;
+	}
 
-/** Number of columns in the console window. */
-const int NUM_COLS = 80;
+	batch_free(b);
+	report_results(results, games, seed,
+			(now_ns() - start) / (double) NSEC_PER_SEC, verbose);
+	free(slot_game);
+	free(results);
+}
 
-/** Radius of each vertical pipe. */
-const int PIPE_RADIUS = 3;
+/**
+ * Sleeps until a futex word, possibly in memory shared with another process,
+ * no longer holds the given value. Can return early, so callers check again.
+ *
+ * @param word
+ * @param seen Value the word held when last checked.
+ */
+void futex_wait(_Atomic uint32_t *word, uint32_t seen) {
+	syscall(SYS_futex, word, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
 
-/** Width of the opening in each pipe. */
-const int OPENING_WIDTH = 7;
+/**
+ * Wakes everyone sleeping on a futex word in futex_wait().
+ *
+ * @param word
+ */
+void futex_wake(_Atomic uint32_t *word) {
+	syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
 
-/** Flappy stays in this column. */
-const int FLAPPY_COL = 10;
+/**
+ * Finds one of the arrays in an environment segment.
+ *
+ * @param h
+ * @param a
+ *
+ * @return The array, h->n entries.
+ */
+static inline int *env_data(env_header *h, env_array a) {
+	return (int *) ((char *) h + h->offset[a]);
+}
 
-/** Aiming for this many frames per second. */
-const float TARGET_FPS = 24;
+/**
+ * Creates a POSIX shared-memory segment for a batch of n games, replacing any
+ * left over by an earlier run. Every array starts on a cache line of its own.
+ * The magic number is left for the caller to store once it's ready.
+ *
+ * @param name Name of the segment, e.g. "/flap-env".
+ * @param n
+ * @param[out] size Receives the size of the segment.
+ *
+ * @return The segment, or NULL with errno set.
+ */
+env_header *env_open(const char *name, int n, size_t *size) {
+	size_t head = (sizeof(env_header) + CACHE_LINE - 1) / CACHE_LINE *
+			CACHE_LINE;
+	size_t stride = (n * sizeof(int) + CACHE_LINE - 1) / CACHE_LINE *
+			CACHE_LINE;
+	env_header *h;
+	int fd, i;
 
-/** Amount of time the splash screen stays up. */
-const float START_TIME_SEC = 3;
+	*size = head + NUM_ENV_ARRAYS * stride;
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+		return NULL;
+	if (ftruncate(fd, *size) < 0 || (h = mmap(NULL, *size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	close(fd);
 
-/** Length of the "progress bar" on the status screen. */
-const int PROG_BAR_LEN = 76;
+	h->n = n;
+	h->rows = NUM_ROWS;
+	h->cols = NUM_COLS;
+	h->row_scale = ROW_SCALE;
+	for (i = 0; i < NUM_ENV_ARRAYS; i++)
+		h->offset[i] = head + i * stride;
+	return h;
+}
 
-/** Row number at which the progress bar will show. */
-const int PROG_BAR_ROW = 22;
+/**
+ * Works out the observations that aren't part of the batch's own state: the
+ * row Flappy is in, and the next pipe's center and opening, the same pipe
+ * batch_autopilot() aims for.
+ *
+ * @param h
+ * @param b
+ */
+void env_observe(env_header *h, const batch *b) {
+	int i, n = b->n, next;
+	int *restrict row = env_data(h, ENV_ROW);
+	int *restrict center = env_data(h, ENV_NEXT_CENTER);
+	int *restrict top = env_data(h, ENV_TOP);
+	int *restrict bottom = env_data(h, ENV_BOTTOM);
+	const int *restrict y = b->y;
+	const int *restrict c0 = b->center[0], *restrict c1 = b->center[1];
+	const float *restrict oh0 = b->opening_height[0];
+	const float *restrict oh1 = b->opening_height[1];
+	vpipe p;
 
-const int SCORE_START_COL = 62;
+	for (i = 0; i < n; i++) {
+		next = (c0[i] + PIPE_RADIUS + 1 < FLAPPY_COL) |
+				((c1[i] < c0[i]) & (c1[i] + PIPE_RADIUS + 1 >= FLAPPY_COL));
+		p.center = next ? c1[i] : c0[i];
+		p.opening_height = next ? oh1[i] : oh0[i];
+		row[i] = y[i] / ROW_SCALE;
+		center[i] = p.center;
+		top[i] = get_orow(p, NUM_ROWS, 1);
+		bottom[i] = get_orow(p, NUM_ROWS, 0);
+	}
+}
 
-//------------------------------ Global Variables -----------------------------
+/**
+ * Lets another process, such as a reinforcement learning trainer, step a
+ * batch of games through a shared-memory segment, until it asks to quit.
+ * The batch's state lives in the segment itself, so the trainer reads the
+ * observations and writes the actions in place, with nothing copied or
+ * serialized, and each step is one futex round trip. A game that ends stays
+ * on view for one step, then its slot starts the next game; game k is
+ * seeded with seed + k.
+ *
+ * @param name Name of the segment.
+ * @param n Number of games stepped at once.
+ * @param seed
+ * @param max_frames Games are called off after this many frames.
+ *
+ * @return 0, or 1 if the segment couldn't be created.
+ */
+int run_env(const char *name, int n, uint64_t seed, int max_frames) {
+	env_header *h;
+	batch *b;
+	size_t size;
+	uint32_t served = 0;
+	uint64_t next = n;
+	int i, finished = 0;
+	const env_array moved[] = { ENV_FLAP, ENV_Y, ENV_V, ENV_SCORE,
+			ENV_FRAMES, ENV_DEAD };
+	int **fields[sizeof(moved) / sizeof(moved[0])];
 
-/** Frame number. */
-int frame = 0;
+	if (!(h = env_open(name, n, &size))) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return 1;
+	}
 
-/** Number of pipes that have been passed. */
-int score = 0;
+	// Move the batch's own state into the segment, so that stepping the
+	// batch updates what the trainer sees.
+	b = batch_new(n, seed, max_frames);
+	fields[0] = &b->flap;
+	fields[1] = &b->y;
+	fields[2] = &b->v;
+	fields[3] = &b->score;
+	fields[4] = &b->frames;
+	fields[5] = &b->dead;
+	memset(b->flap, 0, n * sizeof(int));
+	for (i = 0; i < sizeof(moved) / sizeof(moved[0]); i++) {
+		memcpy(env_data(h, moved[i]), *fields[i], n * sizeof(int));
+		free(*fields[i]);
+		*fields[i] = env_data(h, moved[i]);
+	}
+	env_observe(h, b);
+	atomic_store(&h->magic, ENV_MAGIC);
+	fprintf(stderr, "serving %d games in %s, seed %llu\n", n, name,
+			(unsigned long long) seed);
 
-/** Number of digits in the score. */
-int sdigs = 1;
+	while (1) {
+		while (atomic_load(&h->request) == served)
+			futex_wait(&h->request, served);
+		served = atomic_load(&h->request);
+		if (atomic_load(&h->quit))
+			break;
 
-/** Best score so far. */
-int best_score = 0;
+		// The trainer has seen the games that ended on the last step.
+		if (finished)
+			for (i = 0; i < n; i++)
+				if (b->dead[i] != ALIVE)
+					batch_start(b, i, seed + next++);
+		finished = batch_step(b, b->flap);
+		env_observe(h, b);
 
-/** Number of digits in the best score. */
-int bdigs = 1;
+		atomic_store(&h->done, served);
+		futex_wake(&h->done);
+	}
 
-/** The vertical pipe obstacles. */
-vpipe p1, p2;
+	for (i = 0; i < sizeof(moved) / sizeof(moved[0]); i++)
+		*fields[i] = NULL;
+	batch_free(b);
+	munmap(h, size);
+	shm_unlink(name);
+	return 0;
+}
 
-//---------------------------------- Functions --------------------------------
+/**
+ * Results of benchmarked pure functions are stored here on every iteration,
+ * so the compiler can neither drop the calls nor hoist them out of the loop.
+ */
+volatile int bench_sink;
 
 /**
- * Converts the given char into a string.
+ * Puts a game in the state the micro-benchmarks start from: a few seconds
+ * into a seeded autopilot game, with the first pipe right at Flappy.
  *
- * @param ch Char to convert to a string.
- * @param[out] str Receives 'ch' into a null-terminated C string. Assumes
- * str had 2 bytes allocated.
+ * @param[out] g
  */
-void chtostr(char ch, char *str) {
-	str[0] = ch;
-	str[1] = '\0';
+void bench_game(game *g) {
+	int i;
+
+	game_init(g, 1, 1, NUM_ROWS, NUM_COLS);
+	for (i = 0; i < 100; i++)
+		physics_tick(g, autopilot_flap(g));
+	g->pipes[pipe_index(g, next_pipe(g))].center = FLAPPY_COL;
 }
 
 /**
- * "Moving" floor and ceiling are written into the window array.
+ * Advances a benchmark game by one autopilot tick, starting it over if
+ * Flappy dies, so that frame benchmarks see a moving scene.
  *
- * @param ceiling_row
- * @param floor_row
- * @param ch Char to use for the ceiling and floor.
- * @param spacing Between chars in the floor and ceiling
- * @param col_start Stagger the beginning of the floor and ceiling chars
- * by this much
+ * @param g
  */
-void draw_floor_and_ceiling(int ceiling_row, int floor_row,
-		char ch, int spacing, int col_start) {
-	char c[2];
-	chtostr(ch, c);
-	int i;
-	for (i = col_start; i < NUM_COLS - 1; i += spacing) {
-		if (i < SCORE_START_COL - sdigs - bdigs)
-			mvprintw(ceiling_row, i, c);
-		mvprintw(floor_row, i, c);
+void bench_tick(game *g) {
+	if (physics_tick(g, autopilot_flap(g)) != ALIVE) {
+		end_game(g);
+		reset_world(g);
 	}
 }
 
+void bench_get_flappy_position(game *g, long iters) {
+	while (iters--)
+		bench_sink = get_flappy_position(g->f);
+}
+
+void bench_flappy_fall(game *g, long iters) {
+	flappy f = g->f;
+	while (iters--) {
+		flappy_fall(&f);
+		if (f.t > 100)
+			flappy_launch(&f, NUM_ROWS / 2);
+	}
+	bench_sink += f.row;
+}
+
+void bench_crashed_into_pipe(game *g, long iters) {
+	while (iters--)
+		bench_sink = crashed_into_pipe(g->f, g->pipes[0], g->rows) +
+				crashed_into_pipe(g->f, g->pipes[1], g->rows);
+}
+
+void bench_physics_tick(game *g, long iters) {
+	while (iters--)
+		bench_tick(g);
+}
+
+void bench_autopilot_flap(game *g, long iters) {
+	while (iters--)
+		bench_sink = autopilot_flap(g);
+}
+
 /**
- * Updates the pipe center and opening height for each new frame. If the pipe
- * is sufficiently far off-screen to the left the center is wrapped around to
- * the right, at which time the opening height is changed.
+ * Searching from a fixed state mostly hits a crash right away, so this one
+ * plays on, through pipes, like the headless games do.
  */
-void pipe_refresh(vpipe *p) {
+void bench_lookahead_flap(game *g, long iters) {
+	while (iters--) {
+		if (physics_tick(g, lookahead_flap(g)) != ALIVE) {
+			end_game(g);
+			reset_world(g);
+		}
+	}
+}
+
+void bench_draw_pipe(game *g, long iters) {
+	while (iters--)
+		draw_pipe(&fb, g, g->pipes[0], '|', '=', '=', 0, g->rows - 1);
+}
 
-	// If pipe exits screen on the left then wrap it to the right side of the
-	// screen.
-	if(p->center + PIPE_RADIUS < 0) {
-		p->center = NUM_COLS + PIPE_RADIUS;
+void bench_draw_floor_and_ceiling(game *g, long iters) {
+	while (iters--)
+		draw_floor_and_ceiling(&fb, g, 0, g->rows - 1, '/', 2, iters % 2);
+}
+
+void bench_draw_flappy(game *g, long iters) {
+	while (iters--)
+		draw_flappy(&fb, g);
+}
+
+void bench_frame_fb(game *g, long iters) {
+	while (iters--) {
+		bench_tick(g);
+		compose_frame(&fb, g);
+	}
+}
+
+/** Draws through ncurses or, for the ANSI benchmarks, with ANSI escapes. */
+void bench_frame(game *g, long iters) {
+	while (iters--) {
+		bench_tick(g);
+		render_frame(g);
+	}
+}
 
-		// Get an opening height fraction.
-		p->opening_height = rand() / ((float) INT_MAX) * 0.5 + 0.25;
-		score++;
-		if(sdigs == 1 && score > 9)
-			sdigs++;
-		else if(sdigs == 2 && score > 99)
-			sdigs++;
+/** The way every frame was drawn before damage tracking: clear and redraw. */
+void bench_frame_clear(game *g, long iters) {
+	while (iters--) {
+		bench_tick(g);
+		screen_clear();
+		render_frame(g);
 	}
-	p->center--;
 }
 
+/** Every micro-benchmark, in the order they're run. */
+const benchmark BENCHMARKS[] = {
+	{ "get_flappy_position", bench_get_flappy_position, 0, 0 },
+	{ "flappy_fall", bench_flappy_fall, 0, 0 },
+	{ "crashed_into_pipe", bench_crashed_into_pipe, 0, 0 },
+	{ "physics_tick", bench_physics_tick, 0, 0 },
+	{ "autopilot_flap", bench_autopilot_flap, 0, 0 },
+	{ "lookahead_flap", bench_lookahead_flap, 0, 0 },
+	{ "draw_pipe", bench_draw_pipe, 0, 0 },
+	{ "draw_floor_and_ceiling", bench_draw_floor_and_ceiling, 0, 0 },
+	{ "draw_flappy", bench_draw_flappy, 0, 0 },
+	{ "frame_fb", bench_frame_fb, 0, 0 },
+	{ "frame_curses", bench_frame, 1, 0 },
+	{ "frame_curses_clear", bench_frame_clear, 1, 0 },
+	{ "frame_ansi", bench_frame, 1, 1 },
+	{ "frame_ansi_clear", bench_frame_clear, 1, 1 },
+};
+
 /**
- * Gets the row number of the top or bottom of the opening in the given pipe.
+ * Gets the number of bytes written to a file so far.
  *
- * @param p The pipe obstacle.
- * @param top Should be 1 for the top, 0 for the bottom.
+ * @param f
  *
- * @return Row number.
+ * @return Size in bytes.
  */
-int get_orow(vpipe p, int top) {
-	return p.opening_height * (NUM_ROWS - 1) -
-			(top ? 1 : -1) * OPENING_WIDTH / 2;
+long long bytes_written(FILE *f) {
+	struct stat st;
+	fflush(f);
+	fstat(fileno(f), &st);
+	return st.st_size;
 }
 
 /**
- * Draws the given pipe on the window using 'vch' as the character for the
- * vertical part of the pipe and 'hch' as the character for the horizontal
- * part.
+ * Runs every micro-benchmark and prints one tab-separated line per benchmark:
+ * name, iterations per timed batch, nanoseconds per operation and, for the
+ * ones that draw to the terminal, bytes sent to the terminal per operation.
+ * Terminal output goes to a dummy ncurses screen backed by a temporary file,
+ * and ANSI output to another, so the byte counts are exact and no tty is
+ * needed.
  *
- * @param p
- * @param vch Character for vertical part of pipe
- * @param hcht Character for horizontal part of top pipe
- * @param hchb Character for horizontal part of lower pipe
- * @param ceiling_row Start the pipe just below this
- * @param floor_row Star the pipe jut above this
+ * @return 0 on success, 1 if the dummy screen couldn't be set up.
  */
-void draw_pipe(vpipe p, char vch, char hcht, char hchb,
-		int ceiling_row, int floor_row) {
-	int i, upper_terminus, lower_terminus;
-	char c[2];
+int run_benchmarks() {
+	const char *term = getenv("TERM");
+	FILE *out = tmpfile(), *raw = tmpfile(), *in = fopen("/dev/null", "r");
+	SCREEN *screen;
+	game g;
+	long iters;
+	long long start, bytes, elapsed, times[BENCH_RUNS];
+	int i, j, k;
 
-	// Draw vertical part of upper half of pipe.
-	for(i = ceiling_row + 1; i < get_orow(p, 1); i++) {
-		if ((p.center - PIPE_RADIUS) >= 0 &&
-				(p.center - PIPE_RADIUS) < NUM_COLS - 1) {
-			chtostr(vch, c);
-			mvprintw(i, p.center - PIPE_RADIUS, c);
-		}
-		if ((p.center + PIPE_RADIUS) >= 0 &&
-				(p.center + PIPE_RADIUS) < NUM_COLS - 1) {
-			chtostr(vch, c);
-			mvprintw(i, p.center + PIPE_RADIUS, c);
-		}
+	if (!out || !raw || !in ||
+			!(screen = newterm(term && *term ? (char *) term : "xterm",
+			out, in))) {
+		fprintf(stderr, "can't set up a dummy terminal\n");
+		return 1;
 	}
-	upper_terminus = i;
+	set_term(screen);
+	curs_set(0);
+	fb_init(NUM_ROWS, NUM_COLS);
 
-	// Draw horizontal part of upper part of pipe.
-	for (i = -PIPE_RADIUS; i <= PIPE_RADIUS; i++) {
-		if ((p.center + i) >= 0 &&
-				(p.center + i) < NUM_COLS - 1) {
-			chtostr(hcht, c);
-			mvprintw(upper_terminus, p.center + i, c);
-		}
-	}
+	printf("name\titers\tns_per_op\tbytes_per_op\n");
+	for (i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+		bench_game(&g);
+		ansi_fd = BENCHMARKS[i].ansi ? fileno(raw) : -1;
+		ansi_init(&tty, fb.rows, fb.cols);
+		clear();
+		refresh();
+		fb_reset();
 
-	// Draw vertical part of lower half of pipe.
-	for(i = floor_row - 1; i > get_orow(p, 0); i--) {
-		if ((p.center - PIPE_RADIUS) >= 0 &&
-				(p.center - PIPE_RADIUS) < NUM_COLS - 1) {
-			chtostr(vch, c);
-			mvprintw(i, p.center - PIPE_RADIUS, c);
-		}
-		if ((p.center + PIPE_RADIUS) >= 0 &&
-				(p.center + PIPE_RADIUS) < NUM_COLS - 1) {
-			chtostr(vch, c);
-			mvprintw(i, p.center + PIPE_RADIUS, c);
+		// Find an iteration count that takes long enough to time reliably.
+		for (iters = 16; ; iters *= 2) {
+			start = now_ns();
+			BENCHMARKS[i].fn(&g, iters);
+			if (now_ns() - start >= BENCH_MIN_NS)
+				break;
 		}
-	}
-	lower_terminus = i;
 
-	// Draw horizontal part of lower part of pipe.
-	for (i = -PIPE_RADIUS; i <= PIPE_RADIUS; i++) {
-		if ((p.center + i) >= 0 &&
-				(p.center + i) < NUM_COLS - 1) {
-			chtostr(hchb, c);
-			mvprintw(lower_terminus, p.center + i, c);
+		bytes = bytes_written(out) + bytes_written(raw);
+		for (j = 0; j < BENCH_RUNS; j++) {
+			start = now_ns();
+			BENCHMARKS[i].fn(&g, iters);
+			elapsed = now_ns() - start;
+
+			// Insertion sort, for the median.
+			for (k = j; k > 0 && times[k - 1] > elapsed; k--)
+				times[k] = times[k - 1];
+			times[k] = elapsed;
 		}
+		bytes = bytes_written(out) + bytes_written(raw) - bytes;
+
+		printf("%s\t%ld\t%.2f\t", BENCHMARKS[i].name, iters,
+				times[BENCH_RUNS / 2] / (double) iters);
+		if (BENCHMARKS[i].to_screen)
+			printf("%.1f\n", bytes / ((double) iters * BENCH_RUNS));
+		else
+			printf("-\n");
 	}
+
+	ansi_fd = -1;
+	endwin();
+	delscreen(screen);
+	fclose(out);
+	fclose(raw);
+	fclose(in);
+	return 0;
 }
 
 /**
- * Get Flappy's height along its parabolic arc.
+ * Sends the server's output to a session and empties it.
+ * Whatever the socket won't take right now is kept in the session's pending
+ * output and sent when the socket is writable again.
  *
- * @param f Flappy!
+ * @param sv
+ * @param s
+ */
+void session_send(server *sv, session *s) {
+	struct epoll_event ev;
+	ssize_t n = 0;
+
+	if (!s->pending_len) {
+		n = send(s->fd, sv->out.buf, sv->out.len, MSG_NOSIGNAL);
+		if (n < 0)
+			n = 0; // Either would block or the peer's gone; epoll says which.
+	}
+	if (n < sv->out.len) {
+		s->pending = realloc(s->pending, s->pending_len + sv->out.len - n);
+		assert(s->pending);
+		memcpy(s->pending + s->pending_len, sv->out.buf + n, sv->out.len - n);
+		s->pending_len += sv->out.len - n;
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = s;
+		epoll_ctl(sv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+	}
+	sv->out.len = 0;
+}
+
+/**
+ * Composes the session's current screen in the frame buffer and sends the
+ * cells that differ from what the player's terminal shows. Skipped while
+ * earlier output is still pending, so slow connections drop frames instead
+ * of queueing them; session_drain() draws again once it has gone out.
  *
- * @return height as a row count
+ * @param sv
+ * @param s
  */
-int get_flappy_position(flappy f) {
-	return f.h0 + V0 * f.t + 0.5 * GRAV * f.t * f.t;
+void session_draw(server *sv, session *s) {
+	if (s->pending_len)
+		return;
+	if (s->state == ST_DEAD)
+		compose_failure();
+	else
+		compose_frame(&fb, &s->g);
+	sv->out.row = -1; // Where the cursor was left is the session's business.
+	ansi_diff(&sv->out, s->shown);
+	if (sv->out.len)
+		session_send(sv, s);
 }
 
 /**
- * Returns true if Flappy crashed into a pipe.
+ * Sends as much of a session's pending output as its socket takes. Once it
+ * has all gone out, the frames skipped meanwhile are made up for by drawing
+ * the current one, so the last screen of a game, which no tick redraws, is
+ * never lost.
  *
- * @param f Flappy!
- * @param p The vertical pipe obstacle.
+ * @param sv
+ * @param s
  *
- * @return 1 if Flappy crashed, 0 otherwise.
+ * @return 0 on success, -1 if the connection is broken.
  */
-int crashed_into_pipe(flappy f, vpipe p) {
-	if (FLAPPY_COL >= p.center - PIPE_RADIUS - 1 &&
-			FLAPPY_COL <= p.center + PIPE_RADIUS + 1) {
+int session_drain(server *sv, session *s) {
+	struct epoll_event ev;
+	ssize_t n = send(s->fd, s->pending, s->pending_len, MSG_NOSIGNAL);
 
-		if (get_flappy_position(f) >= get_orow(p, 1)  + 1 &&
-				get_flappy_position(f) <= get_orow(p, 0) - 1) {
-			return 0;
-		}
-		else {
-			return 1;
-		}
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	memmove(s->pending, s->pending + n, s->pending_len - n);
+	if ((s->pending_len -= n) == 0)
+		session_draw(sv, s);
+	if (s->pending_len == 0) {
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		epoll_ctl(sv->epfd, EPOLL_CTL_MOD, s->fd, &ev);
 	}
 	return 0;
 }
 
 /**
- * Prints a failure screen asking the user to either play again or quit.
+ * Puts a session in the timer wheel slot for its next tick.
  *
- * @return 1 if the user wants to play again. Exits the program otherwise.
+ * @param sv
+ * @param s
  */
-int failure_screen() {
-	char ch;
-	clear();
-	mvprintw(NUM_ROWS / 2 - 1, NUM_COLS / 2 - 22,
-			"Flappy died :-(. <Enter> to flap, 'q' to quit.\n");
-	refresh();
-	timeout(-1); // Block until user enters something.
-	ch = getch();
-	switch(ch) {
-	case 'q': // Quit.
-		endwin();
-		exit(0);
-		break;
-	default:
-		if (score > best_score)
-			best_score = score;
-		if (bdigs == 1 && best_score > 9)
-			bdigs++;
-		else if(bdigs == 2 && best_score > 99)
-			bdigs++;
-		score = 0;
-		sdigs = 1;
-		return 1; // Restart game.
-	}
-	endwin();
-	exit(0);
+void wheel_insert(server *sv, session *s) {
+	s->slot = (s->next_tick / WHEEL_SLOT_NS) % WHEEL_SLOTS;
+	s->prev = NULL;
+	s->next = sv->wheel[s->slot];
+	if (s->next)
+		s->next->prev = s;
+	sv->wheel[s->slot] = s;
+	sv->on_wheel++;
+}
+
+/**
+ * Takes a session out of the timer wheel, if it's in it.
+ *
+ * @param sv
+ * @param s
+ */
+void wheel_remove(server *sv, session *s) {
+	if (s->slot < 0)
+		return;
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		sv->wheel[s->slot] = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+	s->slot = -1;
+	sv->on_wheel--;
 }
 
 /**
- * Draws Flappy to the screen and shows death message if Flappy collides with
- * ceiling or floor. The user can continue to play or can exit if Flappy
- * dies.
+ * Starts the next game of a session.
  *
- * @param f Flappy the bird!
+ * @param sv
+ * @param s
+ */
+void session_restart(server *sv, session *s) {
+	reset_world(&s->g);
+	s->state = ST_PLAYING;
+	s->flap = 0;
+	s->next_tick = now_ns() + NSEC_PER_SEC / TARGET_FPS;
+	wheel_insert(sv, s);
+}
+
+/**
+ * Accepts a new player and starts their first game right away.
  *
- * @return 0 if Flappy was drawn as expected, 1 if the game should restart.
+ * @param sv
  */
-int draw_flappy(flappy f) {
-	char c[2];
-	int h = get_flappy_position(f);
+void session_open(server *sv) {
+	struct epoll_event ev;
+	session *s;
+	int fd = accept(sv->listen_fd, NULL, NULL);
 
-	// If Flappy crashed into the ceiling or the floor...
-	if (h <= 0 || h >= NUM_ROWS - 1)
-		return failure_screen();
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	s = calloc(1, sizeof(session));
+	assert(s);
+	s->shown = malloc(NUM_ROWS * NUM_COLS);
+	assert(s->shown);
+	memset(s->shown, ' ', NUM_ROWS * NUM_COLS);
+	s->fd = fd;
+	s->slot = -1;
+	game_init(&s->g, sv->seed + sv->sessions_started++, sv->counter_rng,
+			NUM_ROWS, NUM_COLS);
 
-	// If Flappy crashed into a pipe...
-	if (crashed_into_pipe(f, p1) || crashed_into_pipe(f, p2)) {
-		return failure_screen();
-	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = s;
+	epoll_ctl(sv->epfd, EPOLL_CTL_ADD, fd, &ev);
 
-	// If going down, don't flap
-	if (GRAV * f.t + V0 > 0) {
-		chtostr('\\', c);
-		mvprintw(h, FLAPPY_COL - 1, c);
-		mvprintw(h - 1, FLAPPY_COL - 2, c);
-		chtostr('0', c);
-		mvprintw(h, FLAPPY_COL, c);
-		chtostr('/', c);
-		mvprintw(h, FLAPPY_COL + 1, c);
-		mvprintw(h - 1, FLAPPY_COL + 2, c);
-	}
+	ansi_bytes(&sv->out, SESSION_HELLO, sizeof(SESSION_HELLO) - 1);
+	session_send(sv, s);
+	s->state = ST_PLAYING;
+	s->next_tick = now_ns() + NSEC_PER_SEC / TARGET_FPS;
+	wheel_insert(sv, s);
+}
 
-	// If going up, flap!
-	else {
-		// Left wing
-		if (frame % 6 < 3) {
-			chtostr('/', c);
-			mvprintw(h, FLAPPY_COL - 1, c);
-			mvprintw(h + 1, FLAPPY_COL - 2, c);
-		}
-		else {
-			chtostr('\\', c);
-			mvprintw(h, FLAPPY_COL - 1, c);
-			mvprintw(h - 1, FLAPPY_COL - 2, c);
-		}
+/**
+ * Says goodbye to a player and frees their session.
+ *
+ * @param sv
+ * @param s
+ */
+void session_close(server *sv, session *s) {
+	if (!s->pending_len)
+		send(s->fd, SESSION_BYE, sizeof(SESSION_BYE) - 1,
+				MSG_NOSIGNAL | MSG_DONTWAIT);
+	wheel_remove(sv, s);
+	epoll_ctl(sv->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	free(s->pending);
+	free(s->shown);
+	free(s);
+}
+
+/**
+ * Reads whatever a player typed. Telnet commands are skipped, an up arrow
+ * (ESC [ A or ESC O A) asks for a flap on the next tick, 'q' quits and at
+ * game over any other key starts the next game.
+ *
+ * @param sv
+ * @param s
+ *
+ * @return 0 normally, -1 if the session should be closed.
+ */
+int session_input(server *sv, session *s) {
+	unsigned char buf[256], c;
+	ssize_t n, i;
+	int in;
 
-		// Body
-		chtostr('0', c);
-		mvprintw(h, FLAPPY_COL, c);
+	if ((n = recv(s->fd, buf, sizeof(buf), 0)) <= 0)
+		return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
 
-		// Right wing
-		if (frame % 6 < 3) {
-			chtostr('\\', c);
-			mvprintw(h, FLAPPY_COL + 1, c);
-			mvprintw(h + 1, FLAPPY_COL + 2, c);
+	for (i = 0; i < n; i++) {
+		c = buf[i];
+
+		// Telnet: IAC, then a command, then an option for WILL/WONT/DO/DONT,
+		// or a subnegotiation running up to IAC SE.
+		if (s->telnet == 1) {
+			s->telnet = c == TELNET_SB ? 3 : (c >= TELNET_WILL &&
+					c != TELNET_IAC ? 2 : 0);
+			continue;
 		}
-		else {
-			chtostr('/', c);
-			mvprintw(h, FLAPPY_COL + 1, c);
-			mvprintw(h - 1, FLAPPY_COL + 2, c);
+		if (s->telnet == 2) {
+			s->telnet = 0;
+			continue;
+		}
+		if (s->telnet >= 3) {
+			s->telnet = c == TELNET_IAC ? 4 : (s->telnet == 4 &&
+					c == TELNET_SE ? 0 : 3);
+			continue;
+		}
+		if (c == TELNET_IAC) {
+			s->telnet = 1;
+			continue;
 		}
-	}
 
+		if ((in = parse_key(&s->esc, c)) < 0)
+			continue;
+		if (in == IN_QUIT)
+			return -1;
+		if (in == IN_FLAP && s->state == ST_PLAYING)
+			s->flap = 1;
+		else if (s->state == ST_DEAD)
+			session_restart(sv, s);
+	}
 	return 0;
 }
 
 /**
- * Print a splash screen and show a progress bar. NB the ASCII art was
- * generated by patorjk.com.
+ * Runs the ticks of a session that have come due and draws the result.
+ * A session whose game ends shows the failure screen and leaves the timer
+ * wheel, costing nothing until its player presses a key.
+ *
+ * @param sv
+ * @param s
+ * @param now
  */
-void splash_screen() {
-	int i;
-	int r = NUM_ROWS / 2 - 6;
-	int c = NUM_COLS / 2 - 22;
+void session_tick(server *sv, session *s, long long now) {
+	long long tick_ns = NSEC_PER_SEC / TARGET_FPS;
+	int ticks;
 
-	// Print the title.
-	mvprintw(r, c,     " ___ _                       ___ _        _ ");
-	mvprintw(r + 1, c, "| __| |__ _ _ __ _ __ _  _  | _ |_)_ _ __| |");
-	mvprintw(r + 2, c, "| _|| / _` | '_ \\ '_ \\ || | | _ \\ | '_/ _` |");
-	mvprintw(r + 3, c, "|_| |_\\__,_| .__/ .__/\\_, | |___/_|_| \\__,_|");
-	mvprintw(r + 4, c, "           |_|  |_|   |__/                  ");
-	mvprintw(NUM_ROWS / 2 + 1, NUM_COLS / 2 - 10,
-			"Press <up> to flap!");
+	for (ticks = 0; ticks < MAX_CATCHUP_TICKS && now >= s->next_tick;
+			ticks++) {
+		s->next_tick += tick_ns;
+		if (physics_tick(&s->g, s->flap) != ALIVE) {
+			post_score(&s->g, LEADERBOARD_GUEST);
+			end_game(&s->g);
+			s->state = ST_DEAD;
+			session_draw(sv, s);
+			return;
+		}
+		s->flap = 0;
+	}
+	if (now >= s->next_tick)
+		s->next_tick = now + tick_ns;
+	session_draw(sv, s);
+	wheel_insert(sv, s);
+}
 
-	// Print the progress bar.
-	mvprintw(PROG_BAR_ROW, NUM_COLS / 2 - PROG_BAR_LEN / 2 - 1, "[");
-	mvprintw(PROG_BAR_ROW, NUM_COLS / 2 + PROG_BAR_LEN / 2, "]");
-	refresh();
-	for(i = 0; i < PROG_BAR_LEN; i++) {
-		usleep(1000000 * START_TIME_SEC / (float) PROG_BAR_LEN);
-		mvprintw(PROG_BAR_ROW, NUM_COLS / 2 - PROG_BAR_LEN / 2 + i, "=");
-		refresh();
+/**
+ * Runs the sessions in every timer wheel slot up to the current time.
+ *
+ * @param sv
+ *
+ * @return Milliseconds until the next occupied slot is due, at least 1, or
+ * -1 if there are no playing sessions.
+ */
+int wheel_advance(server *sv) {
+	long long now = now_ns(), t, end = now / WHEEL_SLOT_NS;
+	session *s, *next, *due;
+	int i;
+
+	// Sleeping longer than the wheel is around is harmless, since sessions
+	// are checked against their real deadlines; just don't go around twice.
+	if (end - sv->wheel_time > WHEEL_SLOTS)
+		sv->wheel_time = end - WHEEL_SLOTS;
+	for (t = sv->wheel_time + 1; t <= end; t++) {
+		// Pull out the due sessions first, since running them puts them
+		// back in the wheel.
+		due = NULL;
+		for (s = sv->wheel[t % WHEEL_SLOTS]; s; s = next) {
+			next = s->next;
+			if (s->next_tick <= now) {
+				wheel_remove(sv, s);
+				s->next = due;
+				due = s;
+			}
+		}
+		for (s = due; s; s = next) {
+			next = s->next;
+			session_tick(sv, s, now);
+		}
 	}
-	usleep(1000000 * 0.5);
+	// Slot 'end' may still hold sessions due later in this interval, so it's
+	// scanned again next time, and waited for by a whole interval at most.
+	sv->wheel_time = end - 1;
+
+	if (!sv->on_wheel)
+		return -1;
+	for (i = 0; i < WHEEL_SLOTS && !sv->wheel[(end + i) % WHEEL_SLOTS]; i++)
+		;
+	return i ? i : 1;
 }
 
-//------------------------------------ Main -----------------------------------
+/**
+ * Serves games over TCP until killed. Every connection gets its own game,
+ * drawn as raw ANSI escapes for an 80 x 24 terminal, e.g. for
+ * `telnet host port`. One thread serves all of them: epoll wakes it for
+ * input and a timer wheel for the sessions whose ticks are due.
+ *
+ * @param port
+ * @param seed Session k is seeded with seed + k.
+ * @param counter_rng If nonzero, draw pipe openings in counter mode.
+ *
+ * @return 1 if the server couldn't be started; doesn't return otherwise.
+ */
+int run_server(int port, uint64_t seed, int counter_rng) {
+	struct sockaddr_in addr;
+	struct epoll_event ev, events[64];
+	server sv;
+	session *s;
+	int i, n, timeout_ms = -1, one = 1;
 
-int main()
-{
-	int leave_loop = 0;
-	int ch;
-	flappy f;
-	int restart = 1;
+	memset(&sv, 0, sizeof(sv));
+	sv.seed = seed;
+	sv.counter_rng = counter_rng;
+	sv.wheel_time = now_ns() / WHEEL_SLOT_NS;
+	fb_init(NUM_ROWS, NUM_COLS);
+	ansi_init(&sv.out, NUM_ROWS, NUM_COLS);
 
-	srand(time(NULL));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if ((sv.listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+			setsockopt(sv.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+			sizeof(one)) < 0 ||
+			bind(sv.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+			listen(sv.listen_fd, SERVER_BACKLOG) < 0 ||
+			(sv.epfd = epoll_create1(0)) < 0) {
+		fprintf(stderr, "port %d: %s\n", port, strerror(errno));
+		return 1;
+	}
+	fcntl(sv.listen_fd, F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // The listening socket.
+	epoll_ctl(sv.epfd, EPOLL_CTL_ADD, sv.listen_fd, &ev);
+	fprintf(stderr, "serving on port %d, seed %llu\n", port,
+			(unsigned long long) seed);
 
-	// Initialize ncurses
-	initscr();
-	raw();					// Disable line buffering
-	keypad(stdscr, TRUE);
-	noecho();				// Don't echo() for getch
-	curs_set(0);
-	timeout(0);
+	while (1) {
+		n = epoll_wait(sv.epfd, events, 64, timeout_ms);
+		for (i = 0; i < n; i++) {
+			if (!(s = events[i].data.ptr)) {
+				session_open(&sv);
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && session_drain(&sv, s) < 0) {
+				session_close(&sv, s);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+					session_input(&sv, s) < 0)
+				session_close(&sv, s);
+		}
+		timeout_ms = wheel_advance(&sv);
+	}
+}
+
+/** The difficulty presets there are, as listed in config.h. */
+const char *PRESETS[] = { PRESET_NAMES };
+
+/**
+ * Runs the build of another difficulty preset, flap-name, with the same
+ * arguments. Every preset's constants are compiled into its own build (make
+ * builds them all), so choosing one at run time costs nothing per frame.
+ * The build is looked for next to this executable, which is found through
+ * /proc/self/exe where there is one and otherwise through argv[0]; if that
+ * has no directory either, it's looked for on the PATH.
+ *
+ * Returns only if that build can't be run, after saying why on stderr.
+ *
+ * @param name
+ * @param argv
+ */
+void exec_preset(const char *name, char **argv) {
+	char path[PATH_MAX];
+	char *slash;
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
 
-	splash_screen();
+	if (len >= 0)
+		path[len] = '\0';
+	else
+		snprintf(path, sizeof(path), "%s", argv[0]);
+	if ((slash = strrchr(path, '/'))) {
+		snprintf(slash + 1, sizeof(path) - (slash + 1 - path), "flap-%s",
+				name);
+		execv(path, argv);
+	} else {
+		snprintf(path, sizeof(path), "flap-%s", name);
+		execvp(path, argv);
+	}
+	fprintf(stderr, "can't run %s for -d %s: %s\n"
+			"(make builds every preset next to flap; it has to stay there)\n",
+			path, name, strerror(errno));
+}
 
-	while(!leave_loop) {
+/**
+ * Prints command-line usage to stderr.
+ *
+ * @param prog Name the program was invoked as.
+ */
+void usage(const char *prog) {
+	fprintf(stderr,
+			"usage: %s [-H] [-j threads | -B lanes] [-g games] [-f frames] "
+			"[-s seed] [-C] [-r file | -p file] [-a secs] [-n] [-A] [-T] [-b]\n"
+			"       [-l port] [-S file] [-c file] [-m policy] [-E name] "
+			"[-d preset] [-v]\n"
+			"  -H         headless: simulate with the autopilot, no terminal\n"
+			"  -j threads headless, spreading the games across threads\n"
+			"  -B lanes   headless, stepping this many games at once\n"
+			"  -g games   number of headless games (default %d)\n"
+			"  -f frames  stop a headless game after this many frames "
+			"(default %d)\n"
+			"  -s seed    seed for the pipe openings (headless game g gets "
+			"seed + g)\n"
+			"  -C         counter mode: pipe n's opening depends only on the "
+			"seed and n\n"
+			"  -r file    record the session's keystrokes to a replay file\n"
+			"  -p file    play a replay file back (at full speed with -H)\n"
+			"  -a secs    after game over, start the next game after secs\n"
+			"  -n         skip the splash screen (or set FLAP_NO_SPLASH)\n"
+			"  -A         draw with raw ANSI escapes instead of ncurses\n"
+			"  -T         read the keyboard on a thread of its own\n"
+			"  -b         run the micro-benchmarks and print the results\n"
+			"  -l port    serve games over TCP (telnet) on port\n"
+			"  -S file    keep a leaderboard, shared by all players, in file\n"
+			"  -c file    capture what's drawn to an asciicast file (in replay "
+			"time with\n"
+			"             -H -p)\n"
+			"  -m policy  let a bot play, headless or not: simple (the default "
+			"headless)\n"
+			"             or lookahead\n"
+			"  -E name    let another process step -B lanes games through "
+			"shared memory\n"
+			"  -d preset  play with another difficulty preset: normal, easy or "
+			"hard\n"
+			"             (this build is %s)\n"
+			"  -v         print the outcome of every headless game\n",
+			prog, DEFAULT_HEADLESS_GAMES, DEFAULT_MAX_FRAMES, PRESET_NAME);
+#ifdef PROFILE
+	fprintf(stderr,
+			"  -O         show each frame's phase timings next to the score\n"
+			"  -P file    write frame-time percentiles and a histogram to file "
+			"on exit\n");
+#endif
+}
 
-		// If we're just starting a game then do some initializations.
-		if (restart) {
-			timeout(0); // Don't block on input.
+//------------------------------------ Main -----------------------------------
 
-			// Start the pipes just out of view on the right.
-			p1.center = (int)(1.2 * (NUM_COLS - 1));
-			p1.opening_height = rand() / ((float) INT_MAX) * 0.5 + 0.25;
-			p2.center = (int)(1.75 * (NUM_COLS - 1));
-			p2.opening_height = rand() / ((float) INT_MAX) * 0.5 + 0.25;
+int main(int argc, char **argv)
+{
+	int opt, i;
+	int headless = 0, verbose = 0, lanes = 0, threads = 1, counter_rng = 0;
+	int bench = 0, port = 0, ansi = 0, threaded_keys = 0;
+	int splash = !getenv("FLAP_NO_SPLASH");
+	long long restart_ns = -1;
+	const char *record_path = NULL, *replay_path = NULL, *scores_path = NULL;
+	const char *cast_path = NULL, *env_name = NULL, *preset = NULL;
+	recorder rec;
+	replay rp;
+	game g;
+	int status = 0;
 
-			// Initialize flappy
-			f.h0 = NUM_ROWS / 2;
-			f.t = 0;
-			restart = 0;
-		}
+	// Different for every run, even for runs started in the same second.
+	uint64_t seed = mix64((uint64_t) time(NULL) * NSEC_PER_SEC + now_ns()) ^
+			getpid();
+	int games = DEFAULT_HEADLESS_GAMES, max_frames = DEFAULT_MAX_FRAMES;
 
-		usleep((unsigned int) (1000000 / TARGET_FPS));
+	// A build of one preset linked with the library of another would mix
+	// their physics, e.g. after make PRESET=hard without make clean.
+	if (strcmp(ab_preset(), PRESET_NAME)) {
+		fprintf(stderr, "%s: built for preset %s, but its libasciibird for "
+				"%s (try make clean)\n", argv[0], PRESET_NAME, ab_preset());
+		return 1;
+	}
 
-		// Process keystrokes.
-		ch = -1;
-		ch = getch();
-		switch (ch) {
-		case 'q': // Quit.
-			endwin();
-			exit(0);
+	while ((opt = getopt(argc, argv,
+			"Hj:B:g:f:s:Cr:p:a:nATbl:S:c:m:E:d:v" PROFILE_OPTS)) != -1) {
+		switch (opt) {
+		case 'H':
+			headless = 1;
+			break;
+		case 'j':
+			headless = 1;
+			threads = atoi(optarg);
+			break;
+		case 'B':
+			lanes = atoi(optarg);
+			break;
+		case 'g':
+			games = atoi(optarg);
+			break;
+		case 'f':
+			max_frames = atoi(optarg);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 0);
+			break;
+		case 'C':
+			counter_rng = 1;
+			break;
+		case 'r':
+			record_path = optarg;
+			break;
+		case 'p':
+			replay_path = optarg;
+			break;
+		case 'a':
+			restart_ns = atof(optarg) * NSEC_PER_SEC;
+			break;
+		case 'n':
+			splash = 0;
+			break;
+		case 'A':
+			ansi = 1;
+			break;
+		case 'T':
+			threaded_keys = 1;
+			break;
+		case 'b':
+			bench = 1;
+			break;
+		case 'l':
+			port = atoi(optarg);
+			break;
+		case 'S':
+			scores_path = optarg;
+			break;
+		case 'c':
+			cast_path = optarg;
+			break;
+		case 'E':
+			env_name = optarg;
+			break;
+		case 'd':
+			preset = optarg;
 			break;
-		case KEY_UP: // Give Flappy a boost!
-			f.h0 = get_flappy_position(f);
-			f.t = 0;
+		case 'm':
+			if (!(bot = find_policy(optarg))) {
+				fprintf(stderr, "%s: no such policy\n", optarg);
+				return 1;
+			}
 			break;
-		default: // Let Flappy fall along his parabola.
-			f.t++;
+		case 'v':
+			verbose = 1;
+			break;
+#ifdef PROFILE
+		case 'P':
+			prof_path = optarg;
+			break;
+		case 'O':
+			prof_overlay = 1;
+			break;
+#endif
+		default:
+			usage(argv[0]);
+			return 1;
 		}
+	}
 
-		clear();
-
-		// Print "moving" floor and ceiling
-		draw_floor_and_ceiling(0, NUM_ROWS - 1, '/', 2, frame % 2);
-
-		// Update pipe locations and draw them.
-		draw_pipe(p1, '|', '=', '=', 0, NUM_ROWS - 1);
-		draw_pipe(p2, '|', '=', '=', 0, NUM_ROWS - 1);
-		pipe_refresh(&p1);
-		pipe_refresh(&p2);
-
-		// Draw Flappy. If Flappy crashed and user wants a restart...
-		if(draw_flappy(f)) {
-			restart = 1;
-			continue; // ...then restart the game.
+	if (preset && strcmp(preset, PRESET_NAME)) {
+		for (i = 0; i < sizeof(PRESETS) / sizeof(PRESETS[0]); i++)
+			if (!strcmp(PRESETS[i], preset))
+				break;
+		if (i == sizeof(PRESETS) / sizeof(PRESETS[0])) {
+			fprintf(stderr, "%s: no such preset\n", preset);
+			return 1;
 		}
+		exec_preset(preset, argv);
+		return 1;
+	}
+	if (ansi)
+		ansi_fd = STDOUT_FILENO;
+	if (bot && lanes > 0) {
+		fprintf(stderr, "-B always plays with the simple policy\n");
+		return 1;
+	}
+	if (scores_path && !(scores = leaderboard_open(scores_path))) {
+		fprintf(stderr, "%s: %s\n", scores_path, strerror(errno));
+		return 1;
+	}
 
-		mvprintw(0, SCORE_START_COL - bdigs - sdigs,
-				" Score: %d  Best: %d", score, best_score);
+#ifdef PROFILE
+	profile_init();
+#endif
 
-		// Display all the chars for this frame.
-		refresh();
-		frame++;
+	if (bench)
+		status = run_benchmarks();
+	else if (port > 0)
+		status = run_server(port, seed, counter_rng);
+	else if (replay_path) {
+		if (replay_open(&rp, replay_path)) {
+			fprintf(stderr, "%s: %s\n", replay_path, strerror(errno));
+			return 1;
+		}
+		if (headless) {
+			if (cast_path &&
+					!(cast = capture_open(cast_path, rp.rows, rp.cols))) {
+				fprintf(stderr, "%s: %s\n", cast_path, strerror(errno));
+				return 1;
+			}
+			status = run_replay(&rp, verbose) ? 1 : 0;
+		}
+		else {
+			curses_init();
+			if (cast_path &&
+					!(cast = capture_open(cast_path, LINES, COLS))) {
+				endwin();
+				fprintf(stderr, "%s: %s\n", cast_path, strerror(errno));
+				return 1;
+			}
+			if (threaded_keys)
+				key_reader_start();
+			game_init(&g, rp.seed, rp.counter_rng, rp.rows, rp.cols);
+			play_interactive(&g, NULL, &rp, -1, 0);
+			key_reader_stop();
+			endwin();
+		}
+		replay_close(&rp);
+	}
+	else if (env_name)
+		status = run_env(env_name, lanes > 0 ? lanes : 1, seed, max_frames);
+	else if (lanes > 0)
+		run_batch(games, lanes, seed, max_frames, verbose);
+	else if (headless)
+		run_headless(games, threads, seed, counter_rng, max_frames, verbose);
+	else {
+		// The world is as big as the terminal.
+		curses_init();
+		if (record_path && recorder_open(&rec, record_path, seed,
+				counter_rng, LINES, COLS)) {
+			endwin();
+			fprintf(stderr, "%s: %s\n", record_path, strerror(errno));
+			return 1;
+		}
+		if (cast_path && !(cast = capture_open(cast_path, LINES, COLS))) {
+			endwin();
+			fprintf(stderr, "%s: %s\n", cast_path, strerror(errno));
+			return 1;
+		}
+		if (threaded_keys)
+			key_reader_start();
+		game_init(&g, seed, counter_rng, LINES, COLS);
+		if (scores)
+			g.best_score = leaderboard_best(scores);
+		play_interactive(&g, record_path ? &rec : NULL, NULL, restart_ns,
+				splash);
+		key_reader_stop();
+		endwin();
+		if (record_path)
+			recorder_close(&rec);
 	}
 
-	endwin();
-
-	return 0;
+	if (cast)
+		capture_close(cast);
+#ifdef PROFILE
+	profile_dump();
+	free(prof_frames);
+#endif
+	return status;
 }